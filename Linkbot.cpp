@@ -1,17 +1,31 @@
 
 #include <Arduino.h>
 
+#include "LinkbotBus.h"
+#include "LinkbotScheduler.h"
+
 extern "C" {
 #include "Linkbot.h"
 #include "utility/commands.h"
 #include "utility/twi.h"
+#include "utility/framepool.h"
+#include "utility/framing.h"
 #include <math.h>
-
-void dprint(const char* buf) {
-    Serial.write(buf);
-}
+#include <stdarg.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 } // extern "C"
 
+/* Debugging output is compiled in only if LINKBOT_DEBUG is defined. The
+ * strings are kept in flash. */
+#ifdef LINKBOT_DEBUG
+#define dprint(s) Serial.print(F(s))
+#define dprintnum(n) Serial.print(n)
+#else
+#define dprint(s)
+#define dprintnum(n)
+#endif
+
 
 static void rmemcpy(void *dest, const void *src, size_t n) {
     const uint8_t* _src = (const uint8_t*)src;
@@ -21,407 +35,2197 @@ static void rmemcpy(void *dest, const void *src, size_t n) {
     }
 }
 
-volatile uint8_t g_recvBytes = 0;
-uint8_t g_recvBuf[256];
+/* Transactions waiting for a response. Several may be outstanding at once
+ * when blocking calls are made from more than one task. A response goes to
+ * the transaction waiting on the robot it came from. The local robot's
+ * responses carry its own zigbee address, which the sketch may not know, so
+ * a response from a robot not on the bus's list goes to a transaction
+ * waiting on address 0, and its source is then taken for the local robot's
+ * address. From then on, only that address's responses go to address 0. */
+#define MAX_PENDING 4
+#define SLOT_FREE    0
+#define SLOT_WAITING 1
+#define SLOT_DONE    2
+#define SLOT_ABORTED 3
+#define SLOT_ORPHAN  4  /* abandoned; swallows the response still to come */
+typedef struct pendingResponse_s {
+  uint16_t addr;
+  volatile uint8_t state;
+  volatile uint8_t error;   /* outcome of sending the request */
+  uint8_t * volatile frame; /* the response, borrowed from the frame pool */
+  uint8_t length;
+  uint8_t expect;           /* size byte of the response, or 0 for any */
+  uint8_t seq;              /* order the slots were claimed in */
+  unsigned long claimed;
+} pendingResponse_t;
+pendingResponse_t g_pending[MAX_PENDING];
+uint8_t g_pendingSeq = 0;
+uint16_t g_localAddr = 0;  /* the local robot's address, once learned */
+
+/* How long to wait for a response, in milliseconds */
+#define RESPONSE_TIMEOUT 500
+
+/* How often waitAll() and waitAny() ask a moving robot whether it is done,
+ * in milliseconds, when they can't tell how far it has to go, and the
+ * bounds on the interval when they can */
+#define WAIT_INTERVAL 100
+#define WAIT_INTERVAL_MIN 20
+#define WAIT_INTERVAL_MAX 500
+
+/* The states of a robot in waitAll() and waitAny() */
+#define WAIT_IDLE   0
+#define WAIT_MOVING 1
+#define WAIT_ERRORS 2
+#define WAIT_DONE   3
+
+/* What waitAll() and waitAny() know about each robot they wait on */
+typedef struct waitRobot_s {
+  unsigned long next;   /* when to ask it again */
+  unsigned long at;     /* when error was read */
+  float error;          /* its largest motor error, or -1 */
+  uint8_t state;
+} waitRobot_t;
+
+
+/* Framed commands waiting for the robot to pull them */
+linkbotCommandMode_t g_commandMode = LINKBOT_COMMAND_PUSH;
+uint8_t *g_outbox[LINKBOT_OUTBOX_LENGTH];
+volatile uint8_t g_outboxHead = 0;
+volatile uint8_t g_outboxCount = 0;
 
 uint8_t g_twiInitialized = 0;
+uint8_t g_slaveAddr = LINKBOT_SLAVE_ADDR;
+
+/* Address reports arrive unsolicited, so they are queued separately from
+ * command responses */
+#define REPORT_QUEUE_LENGTH 8
+uint8_t g_reports[REPORT_QUEUE_LENGTH][6];
+volatile uint8_t g_reportHead = 0;
+volatile uint8_t g_reportTail = 0;
+
+/* The sources of the most recent responses, so that responses to commands
+ * sent to several robots at once can be told apart */
+#define REPLY_QUEUE_LENGTH 8
+uint16_t g_replySources[REPLY_QUEUE_LENGTH];
+volatile uint8_t g_replyHead = 0;
+volatile uint8_t g_replyTail = 0;
 
 #define DEG2RAD(x) ((x)*M_PI/180.0)
 #define RAD2DEG(x) ((x)*180.0/M_PI)
 
-void onSlaveRX(uint8_t *buf, int len)
-{
-  memcpy(g_recvBuf, buf, len);
-  g_recvBytes = len;
-}
+/* Commands are packed behind room for the link-layer header, so the frame
+ * can be sent from the same block it was built in */
+#define LINK_HEADER_SIZE 5
+#define PACK_OVERFLOW 0xff
 
-Linkbot::Linkbot(uint16_t zigbee_addr)
+/* Linkbot::_link of a robot not yet addressed */
+#define LINK_UNASSIGNED 0xff
+
+/* Field codes of the command table. Argument fields consume one argument
+ * each, except for the constant fields; response fields each store through
+ * one pointer argument. */
+#define F_END   0 /* end of layout */
+#define F_U8    1 /* int, 1 byte. Responses store an int. */
+#define F_U16   2 /* int, 2 bytes msb first */
+#define F_U32   3 /* unsigned long, 4 bytes msb first */
+#define F_FLOAT 4 /* float, sent as is */
+#define F_DEG   5 /* float in degrees, sent in radians */
+#define F_ZERO  6 /* constant 0x00 byte */
+#define F_FF    7 /* constant 0xff byte */
+#define F_PAD4  8 /* repeat the previous 4 bytes for the unused fourth motor */
+#define F_ACCEL 9 /* float in g, received as a signed 16-bit count msb first */
+#define F_SKIP4 10 /* 4 response bytes not stored, for the unused fourth motor */
+
+/* Accelerometer counts per g */
+#define ACCEL_SCALE 16384.0
+
+/* Command flags */
+#define CF_NORESPONSE 0x01 /* fire and forget */
+#define CF_GROUP      0x02 /* group command, ends in GRP_CMD_END */
+#define CF_URGENT     0x04 /* sent ahead of everything queued, no response */
+#define CF_MOTION     0x08 /* changes the joints' states or goals */
+#define CF_JOINT      0x10 /* first argument is the one joint it moves */
+
+typedef struct commandDesc_s {
+  uint8_t cmd;
+  uint8_t flags;
+  uint8_t args[8];
+  uint8_t resp[5];
+} commandDesc_t;
+
+/* Indexed by linkbotCommandId_t */
+static const commandDesc_t g_commands[LBCMD_NUMCOMMANDS] PROGMEM = {
+  { BTCMD(CMD_STATUS), 0, {F_END}, {F_END} },
+  { BTCMD(CMD_CLEARQUERIEDADDRESSES), 0, {F_END}, {F_END} },
+  { BTCMD(CMD_SETMOTORANGLEPID), CF_MOTION|CF_JOINT, {F_U8, F_DEG}, {F_END} },
+  { BTCMD(CMD_SETMOTORANGLESPID), CF_MOTION, {F_DEG, F_DEG, F_DEG, F_PAD4}, {F_END} },
+  { BTCMD(CMD_GETACCEL), 0, {F_END}, {F_ACCEL, F_ACCEL, F_ACCEL} },
+  { BTCMD(CMD_GETBATTERYVOLTAGE), 0, {F_END}, {F_FLOAT} },
+  { BTCMD(CMD_GETFORMFACTOR), 0, {F_END}, {F_U8} },
+  { BTCMD(CMD_GETHWREV), 0, {F_END}, {F_U8} },
+  { BTCMD(CMD_GETMOTORANGLESABS), 0, {F_END}, {F_DEG, F_DEG, F_DEG, F_SKIP4} },
+  { BTCMD(CMD_GETMOTORANGLESTIMESTAMPABS), 0, {F_END}, {F_U32, F_DEG, F_DEG, F_DEG, F_DEG} },
+  { BTCMD(CMD_GET_MOTOR_ERRORS), 0, {F_END}, {F_DEG, F_DEG, F_DEG, F_DEG} },
+  { BTCMD(CMD_GET_NUM_POSES), 0, {F_END}, {F_U8} },
+  { BTCMD(CMD_GET_POSE_DATA), 0, {F_U8}, {F_DEG, F_DEG, F_DEG} },
+  { BTCMD(CMD_GETRGB), 0, {F_END}, {F_U8, F_U8, F_U8} },
+  { BTCMD(CMD_GETVERSION), 0, {F_END}, {F_U8} },
+  { BTCMD(CMD_IS_MOVING), 0, {F_END}, {F_U8} },
+  { BTCMD(CMD_SETMOTORANGLEABS), CF_MOTION|CF_JOINT, {F_U8, F_DEG}, {F_END} },
+  { BTCMD(CMD_SETMOTORANGLESABS), CF_MOTION, {F_DEG, F_DEG, F_DEG, F_PAD4}, {F_END} },
+  { BTCMD(CMD_MOVE_TO_POSE), CF_MOTION, {F_U8}, {F_END} },
+  { GRPCMD(GRP_CMD_PLAY_POSES), CF_NORESPONSE|CF_GROUP|CF_MOTION, {F_U16}, {F_END} },
+  { BTCMD(CMD_SETMOTORPOWER), CF_URGENT|CF_MOTION, {F_U8, F_ZERO, F_ZERO, F_ZERO, F_ZERO, F_ZERO, F_ZERO}, {F_END} },
+  { BTCMD(CMD_QUERYADDRESSES), 0, {F_END}, {F_END} },
+  { BTCMD(CMD_REBOOT), CF_NORESPONSE, {F_END}, {F_END} },
+  { BTCMD(CMD_RESETABSCOUNTER), 0, {F_END}, {F_END} },
+  { BTCMD(CMD_SAVE_POSE), 0, {F_U8}, {F_END} },
+  { BTCMD(CMD_BUZZERFREQ), 0, {F_U16}, {F_END} },
+  { BTCMD(CMD_SET_GRP), 0, {F_U16, F_U8, F_U8, F_U8}, {F_END} },
+  { BTCMD(CMD_SET_GRP_MASTER), 0, {F_END}, {F_END} },
+  { BTCMD(CMD_SETGLOBALACCEL), 0, {F_DEG}, {F_END} },
+  { BTCMD(CMD_SET_ACCEL), CF_MOTION|CF_JOINT, {F_U8, F_DEG, F_DEG, F_U32}, {F_END} },
+  { BTCMD(CMD_SETMOTORSPEED), 0, {F_U8, F_DEG}, {F_END} },
+  { BTCMD(CMD_SETMOTORDIR), CF_MOTION|CF_JOINT, {F_U8, F_U8}, {F_END} },
+  { BTCMD(CMD_SETMOTORSTATES), CF_MOTION, {F_U8, F_U8, F_U8, F_ZERO, F_DEG, F_DEG, F_DEG, F_PAD4}, {F_END} },
+  { BTCMD(CMD_RGBLED), 0, {F_FF, F_FF, F_FF, F_U8, F_U8, F_U8}, {F_END} },
+  { BTCMD(CMD_SETMOTORPOWER), CF_MOTION, {F_U8, F_U16, F_U16, F_U16}, {F_END} },
+  { BTCMD(CMD_SETMOTORPOWER), CF_NORESPONSE|CF_MOTION, {F_U8, F_U16, F_U16, F_U16}, {F_END} },
+  { BTCMD(CMD_SMOOTHMOVE), CF_MOTION|CF_JOINT, {F_U8, F_DEG, F_DEG, F_DEG, F_DEG}, {F_END} },
+  { BTCMD(CMD_STOP), CF_URGENT|CF_MOTION, {F_END}, {F_END} },
+  /* A wrapped CMD_STOP: group id, no response, then the stop itself */
+  { GRPCMD(GRP_CMD_WRAPPER), CF_URGENT|CF_GROUP|CF_MOTION, {F_U16, F_ZERO, F_U8, F_U8, F_ZERO}, {F_END} },
+  /* CMD_RGBLED with the colour mask given */
+  { BTCMD(CMD_RGBLED), 0, {F_U8, F_U8, F_U8, F_U8, F_U8, F_U8}, {F_END} },
+};
+
+/* Bits of Linkbot::_shadowValid; each says the matching shadow holds the
+ * robot's setting */
+#define SHADOW_LED    0x01
+#define SHADOW_BUZZER 0x02
+#define SHADOW_SPEED1 0x04  /* and 0x08, 0x10 for joints 2 and 3 */
+#define SHADOW_STATE1 0x20  /* and 0x40, 0x80 for joints 2 and 3 */
+#define SHADOW_SPEEDS 0x1c
+#define SHADOW_STATES 0xe0
+
+/* A robot whose slow-changing values are prefetched, with the values which
+ * go stale. Robots which don't prefetch only cache the values which never
+ * change, in the instance itself. */
+typedef struct prefetchEntry_s {
+  Linkbot *robot;
+  unsigned long interval;
+  unsigned long at[LB_CACHE_NUMITEMS]; /* when each item was read */
+  float battery;
+  uint8_t color[3];
+  uint8_t item;   /* item being read, plus one, or 0 */
+  uint8_t txn;    /* the robot's _txn when the read was sent */
+} prefetchEntry_t;
+
+/* The robots which prefetch, and the task which does it */
+static prefetchEntry_t g_prefetch[LINKBOT_MAX_PREFETCH];
+static int g_prefetchTask = -1;
+
+/* Items which go stale, and are only cached while prefetching */
+#define CACHE_STALES ((1 << LB_CACHE_BATTERY) | (1 << LB_CACHE_COLOR))
+
+static prefetchEntry_t* findPrefetch(const Linkbot *robot)
 {
-  _zigbee_addr = zigbee_addr;
-  if(!g_twiInitialized) {
-    twi_init();
-    twi_setAddress(0x02);
-    twi_attachSlaveRxEvent(onSlaveRX);
+  int i;
+  for(i = 0; i < LINKBOT_MAX_PREFETCH; i++) {
+    if(g_prefetch[i].robot == robot) {
+      return &g_prefetch[i];
+    }
   }
+  return NULL;
 }
 
-Linkbot::~Linkbot()
+/* How often the prefetch task looks for an idle bus, in milliseconds */
+#define PREFETCH_POLL 10
+
+/* Bumped by commands which reach robots without going through their
+ * instances, such as stopAll(); an instance whose _shadowEpoch differs
+ * forgets its shadow state */
+static uint8_t g_shadowEpoch;
+
+/* How long to wait for room in the TWI queue, in milliseconds */
+#define SEND_QUEUE_TIMEOUT 50
+
+/* The outcome of the last urgent frame, URGENT_PENDING until it is sent */
+#define URGENT_PENDING 0xFE
+volatile uint8_t g_urgentStatus = TWI_NO_ERROR;
+unsigned long g_urgentLatencyMax = 0;
+
+/* Add to a link counter. The TWI interrupt updates the same counters, so
+ * the read-modify-write must not be split by it. */
+static void linkStatAdd(unsigned long *counter, unsigned long n)
 {
+  uint8_t sreg = SREG;
+  cli();
+  *counter += n;
+  SREG = sreg;
 }
 
-int Linkbot::checkStatus()
+/* Records the outcome of sending a frame, from the TWI interrupt */
+static void onSendComplete(uint8_t error, uint8_t *data, uint8_t length, void *context)
 {
-  packSimpleCmd(BTCMD(CMD_STATUS));
-  return transactMessage();
+  if(context != NULL) {
+    *(volatile uint8_t*)context = error;
+  }
 }
 
-int Linkbot::driveJointTo(int joint, float angle)
+static pendingResponse_t* claimSlot(uint16_t addr, uint8_t expect)
 {
-  driveJointToNB(joint, angle);
-  return moveWait();
+  pendingResponse_t *slot = NULL;
+  uint8_t sreg = SREG;
+  int i;
+  cli();
+  for(i = 0; i < MAX_PENDING; i++) {
+    /* An orphan whose response never came can be taken back */
+    if(g_pending[i].state == SLOT_FREE ||
+       (g_pending[i].state == SLOT_ORPHAN &&
+        (millis() - g_pending[i].claimed) > RESPONSE_TIMEOUT)) {
+      slot = &g_pending[i];
+      slot->addr = addr;
+      slot->expect = expect;
+      slot->seq = g_pendingSeq++;
+      slot->claimed = millis();
+      slot->error = TWI_NO_ERROR;
+      slot->frame = NULL;
+      slot->state = SLOT_WAITING;
+      break;
+    }
+  }
+  SREG = sreg;
+  return slot;
 }
 
-int Linkbot::driveJointToNB(int joint, float angle)
+/* Free a slot, returning the response frame unless it has been taken */
+static void releaseSlot(pendingResponse_t *slot)
 {
-  angle = DEG2RAD(angle);
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORANGLEPID));
-  packBufByte(0x00);
-  packBufByte((uint8_t)joint);
-  packBuf(&angle, 4);
-  packBufByte(0x00);
-  return transactMessage();
+  uint8_t sreg = SREG;
+  cli();
+  framepool_return(slot->frame);
+  slot->frame = NULL;
+  slot->state = SLOT_FREE;
+  SREG = sreg;
 }
 
-int Linkbot::driveTo(float angle1, float angle2, float angle3)
+/* Give up on a slot's transaction. If its response may still come, the
+ * slot is kept to swallow it, so it can't be taken for the response to a
+ * later transaction. */
+static void orphanSlot(pendingResponse_t *slot)
 {
-  driveToNB(angle1, angle2, angle3);
-  return moveWait();
+  uint8_t sreg = SREG;
+  cli();
+  if(slot->state == SLOT_WAITING && slot->error == TWI_NO_ERROR) {
+    slot->state = SLOT_ORPHAN;
+    SREG = sreg;
+    return;
+  }
+  SREG = sreg;
+  releaseSlot(slot);
 }
 
-int Linkbot::driveToNB(float angle1, float angle2, float angle3)
+/* Abort the transactions waiting on a robot, so that the robot's response
+ * to an urgent command is not taken for theirs. A broadcast aborts every
+ * transaction. */
+static void abortSlots(uint16_t addr)
 {
-  angle1 = DEG2RAD(angle1);
-  angle2 = DEG2RAD(angle2);
-  angle3 = DEG2RAD(angle3);
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORANGLESPID));
-  packBufByte(0x00);
-  packBuf(&angle1, 4);
-  packBuf(&angle2, 4);
-  packBuf(&angle3, 4);
-  packBuf(&angle3, 4);
-  packBufByte(0x00);
-  return transactMessage();
+  uint8_t sreg = SREG;
+  int i;
+  cli();
+  for(i = 0; i < MAX_PENDING; i++) {
+    if(addr != LINKBOT_BROADCAST_ADDR && g_pending[i].addr != addr &&
+       g_pending[i].addr != 0) {
+      continue;
+    }
+    if(g_pending[i].state == SLOT_WAITING) {
+      g_pending[i].state = SLOT_ABORTED;
+    } else if(g_pending[i].state == SLOT_ORPHAN) {
+      g_pending[i].state = SLOT_FREE;
+    }
+  }
+  SREG = sreg;
 }
 
-int Linkbot::getAccelerometerData(float &x, float &y, float &z)
+/* Responses don't say which command they answer, so a response shorter
+ * than a transaction expects is not taken for that transaction's. This
+ * keeps the responses to fire-and-forget commands from being mistaken for
+ * the response to a query sent after them. A transaction expecting exactly
+ * the response's size is preferred, but one expecting less may still take
+ * it, in case the firmware adds fields the command table doesn't list. */
+static pendingResponse_t* matchSlot(uint16_t source, uint8_t size)
 {
-  packSimpleCmd(BTCMD(CMD_GETACCEL));
-  transactMessage();
-  memcpy(&x, &g_recvBuf[7], 4);
-  memcpy(&y, &g_recvBuf[11], 4);
-  memcpy(&z, &g_recvBuf[15], 4);
-  return 0;
+  pendingResponse_t *match = NULL;
+  pendingResponse_t *slot;
+  uint8_t matchRank = 0;
+  uint8_t rank;
+  int i;
+  for(i = 0; i < MAX_PENDING; i++) {
+    slot = &g_pending[i];
+    if(slot->state != SLOT_WAITING && slot->state != SLOT_ORPHAN) {
+      continue;
+    }
+    if(slot->expect != 0 && size < slot->expect) {
+      continue;
+    }
+    if(slot->addr == source) {
+      rank = 0;
+    } else if(slot->addr == 0 &&
+              (g_localAddr != 0 ? source == g_localAddr
+                                : !LinkbotBus::isKnown(source))) {
+      rank = 2;
+    } else {
+      continue;
+    }
+    if(slot->expect != 0 && slot->expect != size) {
+      rank++;
+    }
+    /* A robot answers in order, so its oldest transaction gets the
+     * response */
+    if(match == NULL || rank < matchRank ||
+       (rank == matchRank && (int8_t)(slot->seq - match->seq) < 0)) {
+      match = slot;
+      matchRank = rank;
+    }
+  }
+  return match;
 }
 
-int Linkbot::getBatteryVoltage(float &volts)
+/* Hand a frame from the breakout board to whoever waits for it */
+static void deliverFrame(uint8_t *buf, int len)
 {
-  packSimpleCmd(BTCMD(CMD_GETBATTERYVOLTAGE));
-  transactMessage();
-  memcpy(&volts, &g_recvBuf[7], 4);
-  return 0;
+  if((len >= 13) && (buf[5] == EVENT_REPORTADDRESS)) {
+    uint8_t next = (g_reportHead + 1) % REPORT_QUEUE_LENGTH;
+    /* Drop the report if the queue is full */
+    if(next != g_reportTail) {
+      memcpy(g_reports[g_reportHead], &buf[7], 6);
+      g_reportHead = next;
+    }
+    return;
+  }
+  if(len < 4) {
+    return;
+  }
+  uint16_t source = ((uint16_t)buf[2] << 8) | buf[3];
+  uint8_t next = (g_replyHead + 1) % REPLY_QUEUE_LENGTH;
+  if(next != g_replyTail) {
+    g_replySources[g_replyHead] = source;
+    g_replyHead = next;
+  }
+  pendingResponse_t *slot = matchSlot(source, (len > 6) ? buf[6] : 0);
+  if(slot != NULL && slot->addr == 0 && source != 0) {
+    g_localAddr = source;
+  }
+  if(slot != NULL && slot->state == SLOT_ORPHAN) {
+    slot->state = SLOT_FREE;
+    return;
+  }
+  if(slot != NULL) {
+    uint8_t *frame = framepool_borrow();
+    if(frame == NULL) {
+      return;
+    }
+    memcpy(frame, buf, len);
+    slot->frame = frame;
+    slot->length = len;
+    slot->state = SLOT_DONE;
+  }
 }
 
-int Linkbot::getColorRGB(uint8_t &r, uint8_t &g, uint8_t &b)
+void onSlaveRX(uint8_t *buf, int len)
 {
-  return 0;
+  /* Every breakout board writes to the same slave address, so tell the
+   * links apart by the robot the frame came from */
+  if(len >= 4) {
+    g_links[LinkbotBus::linkOf(((uint16_t)buf[2] << 8) | buf[3])].stats.busBytes += len + 1;
+  }
+  deliverFrame(buf, len);
 }
 
-int Linkbot::getFormFactor(int &form)
+/* The robot is reading from us; hand it the oldest queued command. With
+ * nothing queued, the TWI layer sends MSG_SENDEND. */
+static void onSlaveTX()
 {
-  return 0;
+  uint8_t *frame;
+  if(g_outboxCount == 0) {
+    return;
+  }
+  frame = g_outbox[g_outboxHead];
+  /* If the TWI layer had no buffer to send from, the frame stays at the
+   * head of the outbox for the robot's next read */
+  if(twi_transmit(frame, frame[1]) != 0) {
+    return;
+  }
+  g_outboxHead = (g_outboxHead + 1) % LINKBOT_OUTBOX_LENGTH;
+  g_outboxCount--;
+  g_links[0].stats.busBytes += frame[1] + 1;
+  framepool_return(frame);
 }
 
-int Linkbot::getJointAngle(int joint, float &angle)
+/* Queue a frame for the robot to pull, waiting for room if need be */
+static int queueFrame(uint8_t *frame)
 {
-  float angle1, angle2, angle3;
-  float angles[3];
-  getJointAngles(angle1, angle2, angle3);
-  angles[0] = angle1;
-  angles[1] = angle2;
-  angles[2] = angle3;
-  angle = angles[joint-1];
-  return 0;
+  unsigned long startMillis = millis();
+  uint8_t sreg;
+  while(1) {
+    sreg = SREG;
+    cli();
+    if(g_outboxCount < LINKBOT_OUTBOX_LENGTH) {
+      g_outbox[(g_outboxHead + g_outboxCount) % LINKBOT_OUTBOX_LENGTH] = frame;
+      g_outboxCount++;
+      SREG = sreg;
+      return 0;
+    }
+    SREG = sreg;
+    if((millis() - startMillis) > SEND_QUEUE_TIMEOUT) {
+      framepool_return(frame);
+      return -1;
+    }
+    LinkbotScheduler::yield();
+  }
 }
 
-int Linkbot::getJointAngles(float &angle1, float &angle2, float &angle3)
-{
-  packSimpleCmd(BTCMD(CMD_GETMOTORANGLESABS));
-  transactMessage();
-  memcpy(&angle1, &g_recvBuf[7], 4);
-  memcpy(&angle2, &g_recvBuf[11], 4);
-  memcpy(&angle3, &g_recvBuf[15], 4);
-  char buf[32];
-  sprintf(buf, "m1: %d m2: %f, m3: %f, 0x%x%x%x%x\n", (int)(angle1*1000), angle2, angle3,
-          g_recvBuf[7],
-          g_recvBuf[8],
-          g_recvBuf[9],
-          g_recvBuf[10]
-          );
-  Serial.write(buf);
-  angle1 = RAD2DEG(angle1);
-  angle2 = RAD2DEG(angle2);
-  angle3 = RAD2DEG(angle3);
-  sprintf(buf, "m1: %f\n", angle1);
-  Serial.write(buf);
-  return 0;
+/* A poll read has ended. The breakout board answers with MSG_SENDEND when
+ * it holds no response, and with the response frame otherwise. */
+static void onPollComplete(uint8_t error, uint8_t *data, uint8_t length, void *context)
+{
+  linkbotLink_t *link = (linkbotLink_t*)context;
+  link->pollInFlight = 0;
+  link->stats.busBytes += length + 1;
+  if(error != TWI_NO_ERROR || length < 2 || data[0] == MSG_SENDEND) {
+    return;
+  }
+  if(data[1] < length) {
+    length = data[1];
+  }
+  deliverFrame(data, length);
 }
 
-int Linkbot::isMoving()
+/* In LINKBOT_RESPONSE_POLL mode, read a response from a link's breakout
+ * board if it signals one is ready, or if the poll interval has passed */
+static void pollLink(linkbotLink_t *link)
 {
-  packSimpleCmd(BTCMD(CMD_IS_MOVING));
-  transactMessage();
-  return g_recvBuf[7];
+  if(link->responseMode != LINKBOT_RESPONSE_POLL || link->pollInFlight) {
+    return;
+  }
+  if(link->readyPin >= 0) {
+    if(digitalRead(link->readyPin) != LOW) {
+      return;
+    }
+  } else if((millis() - link->lastPoll) < LINKBOT_POLL_INTERVAL) {
+    return;
+  }
+  link->lastPoll = millis();
+  link->pollInFlight = 1;
+  if(twi_readFromAsync(link->addr, TWI_BUFFER_LENGTH, 1, onPollComplete, link)) {
+    link->pollInFlight = 0;
+    return;
+  }
+  linkStatAdd(&link->stats.polls, 1);
 }
 
-int Linkbot::moveJoint(int joint, float angle)
+/* Keep the links moving while waiting on them: restart queued transfers
+ * held off to share the bus, and poll the links which need it */
+static void serviceLink()
 {
-  float _angle;
-  getJointAngle(joint, _angle);
-  moveJointToNB(joint, angle+_angle);
-  moveWait();
-  return 0;
+  int i;
+  twi_service();
+  for(i = 0; i < g_numLinks; i++) {
+    pollLink(&g_links[i]);
+  }
 }
 
-int Linkbot::moveJointNB(int joint, float angle)
+static void beginTwi()
 {
-  float _angle;
-  getJointAngle(joint, _angle);
-  moveJointToNB(joint, angle+_angle);
-  return 0;
+  if(!g_twiInitialized) {
+    twi_init();
+    twi_setAddress(g_slaveAddr);
+    twi_attachSlaveRxEvent(onSlaveRX);
+    twi_attachSlaveTxEvent(onSlaveTX);
+    g_twiInitialized = 1;
+  }
 }
 
-int Linkbot::moveJointTo(int joint, float angle)
+Linkbot::Linkbot(uint16_t zigbee_addr)
 {
-  moveJointToNB(joint, angle);
-  moveWait();
-  return 0;
+  _zigbee_addr = zigbee_addr;
+  /* Global instances are built before setup() adds the links, so the link
+   * is chosen when the robot is first addressed */
+  _link = LINK_UNASSIGNED;
+  _framed = 0;
+  _buf = NULL;
+  _bufsize = 0;
+  _resp = NULL;
+  _respLen = 0;
+  _expect = 0;
+  _slot = NULL;
+  _shadowing = 1;
+  _shadowValid = 0;
+  _shadowEpoch = g_shadowEpoch;
+  _suppressed = 0;
+  _txn = 0;
+  _cacheValid = 0;
+  _goalValid = 0;
+  _motionAt = millis();
+  _movePolling = 0;
+  _movePollAt = millis();
+  beginTwi();
 }
 
-int Linkbot::moveJointToNB(int joint, float angle)
+Linkbot::~Linkbot()
 {
-  angle = DEG2RAD(angle);
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORANGLEABS));
-  packBufByte(0x00);
-  packBufByte(joint);
-  packBuf(&angle, 4);
-  packBufByte(0x00);
-  return transactMessage();
+  disablePrefetch();
+  framepool_return(_buf);
+  releaseResponse();
+  cancelTransaction();
 }
 
-int Linkbot::move(float angle1, float angle2, float angle3)
+/* Send the packed command and claim a slot for its response */
+int Linkbot::beginTransaction()
 {
-  moveNB(angle1, angle2, angle3);
-  moveWait();
+  pendingResponse_t *slot;
+  releaseResponse();
+  /* Only one transaction per instance; forget any unfinished one */
+  cancelTransaction();
+  _txn++;
+  _start = millis();
+  _startMicros = micros();
+  while((slot = claimSlot(_zigbee_addr, _framed ? 0 : _expect)) == NULL) {
+    if((millis() - _start) > RESPONSE_TIMEOUT) {
+      framepool_return(_buf);
+      _buf = NULL;
+      return -1;
+    }
+    LinkbotScheduler::yield();
+  }
+  dprint("!\n");
+  if(sendMessage(&slot->error)) {
+    releaseSlot(slot);
+    return -1;
+  }
+  dprint(".\n");
+  _slot = slot;
   return 0;
 }
 
-int Linkbot::moveNB(float angle1, float angle2, float angle3)
+/* Forget the transaction begun by beginTransaction(), if any */
+void Linkbot::cancelTransaction()
 {
-  float a1, a2, a3;
-  getJointAngles(a1, a2, a3);
-  moveToNB(angle1+a1, angle2+a2, angle3+a3);
-  return 0;
+  if(_slot != NULL) {
+    orphanSlot((pendingResponse_t*)_slot);
+    _slot = NULL;
+  }
 }
 
-int Linkbot::moveTo(float angle1, float angle2, float angle3)
+/* Check whether an item's cached value may be given out without asking
+ * the robot. Items which only change on reboot are cached for good; the
+ * others while prefetching keeps them fresh. */
+int Linkbot::cacheFresh(linkbotCacheItem_t item)
 {
-  moveToNB(angle1, angle2, angle3);
-  moveWait();
+  prefetchEntry_t *prefetch;
+  if(!(_cacheValid & (1 << item))) {
+    return 0;
+  }
+  if(!(CACHE_STALES & (1 << item))) {
+    return 1;
+  }
+  prefetch = findPrefetch(this);
+  return prefetch != NULL &&
+    (millis() - prefetch->at[item]) <= 2 * prefetch->interval;
+}
+
+/* Get the speed a joint was last set to and the robot acknowledged.
+ * Returns -1 if it is not known. */
+int Linkbot::commandedSpeed(int joint, float &speed)
+{
+  if(joint < 1 || joint > 3 || !(_shadowValid & (SHADOW_SPEED1 << (joint-1)))) {
+    return -1;
+  }
+  speed = _shadowSpeeds[joint-1];
   return 0;
 }
 
-int Linkbot::moveToNB(float angle1, float angle2, float angle3)
+/* Mark an item cached. Items which go stale are only kept by robots which
+ * prefetch. */
+void Linkbot::cacheStamp(linkbotCacheItem_t item)
 {
-  angle1 = DEG2RAD(angle1);
-  angle2 = DEG2RAD(angle2);
-  angle3 = DEG2RAD(angle3);
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORANGLESABS));
-  packBufByte(0x00);
-  packBuf(&angle1, 4);
-  packBuf(&angle2, 4);
-  packBuf(&angle3, 4);
-  packBuf(&angle3, 4);
-  packBufByte(0x00);
-  return transactMessage();
+  prefetchEntry_t *prefetch = findPrefetch(this);
+  if(prefetch != NULL) {
+    prefetch->at[item] = millis();
+  } else if(CACHE_STALES & (1 << item)) {
+    return;
+  }
+  _cacheValid |= 1 << item;
 }
 
-int Linkbot::moveWait()
+/* Strip the framing from the response, checking its CRC. Returns 0 if the
+ * response is intact. */
+int Linkbot::checkFrame()
 {
-  while(isMoving()) {
-    delay(100);
+  uint8_t n;
+  if(_resp == NULL || _respLen <= LINK_HEADER_SIZE) {
+    return -1;
   }
+  n = framing_unstuff(&_resp[LINK_HEADER_SIZE], _respLen - LINK_HEADER_SIZE);
+  if(n < 3 || framing_crc8(0, &_resp[LINK_HEADER_SIZE], n - 1) != _resp[LINK_HEADER_SIZE + n - 1]) {
+    return -1;
+  }
+  _respLen = LINK_HEADER_SIZE + n - 1;
   return 0;
 }
 
-int Linkbot::reset()
+int Linkbot::checkStatusAll(const uint16_t addrs[], int num, uint8_t alive[],
+                            unsigned long timeout)
 {
-  packSimpleCmd(BTCMD(CMD_RESETABSCOUNTER));
-  return transactMessage();
+  unsigned long startMillis;
+  uint16_t source;
+  int remaining = num;
+  int i;
+  Linkbot robot;
+  memset(alive, 0, num);
+  g_replyTail = g_replyHead;
+  /* Send every status request first, then collect the responses in
+   * whichever order they arrive */
+  for(i = 0; i < num; i++) {
+    robot._zigbee_addr = addrs[i];
+    robot._link = LinkbotBus::assign(addrs[i]);
+    robot.packSimpleCmd(BTCMD(CMD_STATUS));
+    robot.sendMessage();
+  }
+  startMillis = millis();
+  while(remaining > 0 && (millis() - startMillis) < timeout) {
+    if(g_replyTail == g_replyHead) {
+      serviceLink();
+      continue;
+    }
+    source = g_replySources[g_replyTail];
+    g_replyTail = (g_replyTail + 1) % REPLY_QUEUE_LENGTH;
+    for(i = 0; i < num; i++) {
+      if(addrs[i] == source && !alive[i]) {
+        alive[i] = 1;
+        remaining--;
+        break;
+      }
+    }
+  }
+  return num - remaining;
 }
 
-int Linkbot::resetToZero()
+int Linkbot::downloadPoses(float poses[][3], int maxposes, int &num)
 {
-  reset();
-  moveTo(0, 0, 0);
+  int i;
+  int remote;
+  num = 0;
+  if(getNumPoses(remote)) {
+    return -1;
+  }
+  for(i = 0; i < remote && i < maxposes; i++) {
+    if(getPoseData(i, poses[i][0], poses[i][1], poses[i][2])) {
+      return -1;
+    }
+    num++;
+  }
   return 0;
 }
 
-int Linkbot::setJointSpeed(int joint, float speed)
+int Linkbot::findRobot(const uint8_t serial[4])
 {
-  speed = DEG2RAD(speed);
   packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORSPEED));
+  packBufByte(BTCMD(CMD_FINDMOBOT));
   packBufByte(0x00);
-  packBufByte(joint);
-  packBuf(&speed, 4);
+  packBuf((void*)serial, 4);
   packBufByte(0x00);
-  return transactMessage();
+  /* Only the matching robot answers, with an address report */
+  return sendMessage();
 }
 
-int Linkbot::setJointSpeeds(float speed1, float speed2, float speed3)
+int Linkbot::getBatteryVoltage(float &volts)
 {
-  setJointSpeed(1, speed1);
-  setJointSpeed(2, speed2);
-  setJointSpeed(3, speed3);
+  prefetchEntry_t *prefetch;
+  if(cacheFresh(LB_CACHE_BATTERY)) {
+    volts = findPrefetch(this)->battery;
+    return 0;
+  }
+  if(command(LBCMD_GETBATTERYVOLTAGE, &volts)) {
+    return -1;
+  }
+  if((prefetch = findPrefetch(this)) != NULL) {
+    prefetch->battery = volts;
+    cacheStamp(LB_CACHE_BATTERY);
+  }
   return 0;
 }
 
-int Linkbot::setJointState(int joint, int state)
+unsigned long Linkbot::getCacheAge(linkbotCacheItem_t item)
 {
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORDIR));
-  packBufByte(0x00);
-  packBufByte(joint);
-  packBufByte(state);
-  packBufByte(0x00);
-  return transactMessage();
+  prefetchEntry_t *prefetch = findPrefetch(this);
+  if(item >= LB_CACHE_NUMITEMS || !(_cacheValid & (1 << item)) ||
+     prefetch == NULL) {
+    return (unsigned long)-1;
+  }
+  return millis() - prefetch->at[item];
 }
 
-int Linkbot::setJointStates(int state1, int state2, int state3, float speed1, float speed2, float speed3)
+int Linkbot::getColorRGB(uint8_t &r, uint8_t &g, uint8_t &b)
 {
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORSTATES));
-  packBufByte(0x00);
-  packBufByte(state1);
-  packBufByte(state2);
-  packBufByte(state3);
-  packBufByte(0);
-  packBuf(&speed1, 4);
-  packBuf(&speed2, 4);
-  packBuf(&speed3, 4);
-  packBuf(&speed1, 4);
-  packBufByte(0x00);
-  return transactMessage();
+  prefetchEntry_t *prefetch;
+  int color[3];
+  if(cacheFresh(LB_CACHE_COLOR)) {
+    prefetch = findPrefetch(this);
+    r = prefetch->color[0];
+    g = prefetch->color[1];
+    b = prefetch->color[2];
+    return 0;
+  }
+  if(command(LBCMD_GETRGB, &color[0], &color[1], &color[2])) {
+    return -1;
+  }
+  r = color[0];
+  g = color[1];
+  b = color[2];
+  if((prefetch = findPrefetch(this)) != NULL) {
+    prefetch->color[0] = r;
+    prefetch->color[1] = g;
+    prefetch->color[2] = b;
+    cacheStamp(LB_CACHE_COLOR);
+  }
+  return 0;
 }
 
-int Linkbot::setLEDColor(uint8_t r, uint8_t g, uint8_t b)
+int Linkbot::getFormFactor(int &form)
 {
-  packBufReset();
-  packBufByte(BTCMD(CMD_RGBLED));
-  packBufByte(0xff);
-  packBufByte(0xff);
-  packBufByte(0xff);
-  packBufByte(r);
-  packBufByte(g);
-  packBufByte(b);
-  packBufByte(0x00);
-  return transactMessage();
+  if(!cacheFresh(LB_CACHE_FORMFACTOR)) {
+    if(command(LBCMD_GETFORMFACTOR, &form)) {
+      return -1;
+    }
+    _cacheFormFactor = form;
+    cacheStamp(LB_CACHE_FORMFACTOR);
+  }
+  form = _cacheFormFactor;
+  return 0;
 }
 
-int Linkbot::setMotorPower(int joint, int power)
+int Linkbot::getHardwareRevision(int &revision)
 {
-  uint8_t mask;
-  int16_t _power = power;
-  int i;
-  mask = 1<<joint;
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORPOWER));
-  packBufByte(0x00);
-  packBufByte(mask);
-  for(i = 0; i < 3; i++) {
-    packBufByte(_power>>8);
-    packBufByte(_power&0x00ff);
+  if(!cacheFresh(LB_CACHE_HWREV)) {
+    if(command(LBCMD_GETHWREV, &revision)) {
+      return -1;
+    }
+    _cacheHwRev = revision;
+    cacheStamp(LB_CACHE_HWREV);
   }
-  packBufByte(0x00);
-  return transactMessage();
+  revision = _cacheHwRev;
+  return 0;
 }
 
-int Linkbot::setMotorPowers(int power1, int power2, int power3)
+int Linkbot::getVersion(int &version)
 {
-  int16_t powers[3];
-  int i;
-  powers[0] = power1;
-  powers[1] = power2;
-  powers[2] = power3;
-  packBufReset();
-  packBufByte(BTCMD(CMD_SETMOTORPOWER));
-  packBufByte(0x00);
-  packBufByte(0x07);
-  for(i = 0; i < 3; i++) {
-    packBufByte(powers[i]>>8);
-    packBufByte(powers[i]&0x00ff);
+  if(!cacheFresh(LB_CACHE_VERSION)) {
+    if(command(LBCMD_GETVERSION, &version)) {
+      return -1;
+    }
+    _cacheVersion = version;
+    cacheStamp(LB_CACHE_VERSION);
   }
-  packBufByte(0x00);
-  return transactMessage();
+  version = _cacheVersion;
+  return 0;
 }
 
-int Linkbot::stop()
+int Linkbot::getJointAngle(int joint, float &angle)
 {
-  packSimpleCmd(BTCMD(CMD_STOP));
+  float angle1, angle2, angle3;
+  float angles[3];
+  if(getJointAngles(angle1, angle2, angle3)) {
+    return -1;
+  }
+  angles[0] = angle1;
+  angles[1] = angle2;
+  angles[2] = angle3;
+  angle = angles[joint-1];
+  return 0;
 }
 
-void Linkbot::packBufReset()
+int Linkbot::getQueriedAddresses(uint8_t entries[][6], int maxnum, int &num)
 {
-  _bufsize = 0;
+  int i;
+  int remote;
+  num = 0;
+  packSimpleCmd(BTCMD(CMD_GETQUERIEDADDRESSES));
+  if(transactMessage()) {
+    return -1;
+  }
+  remote = (_resp[6] - 3) / 6;
+  /* Take no more entries than arrived, or than fit a pool block, whatever
+   * the size byte says */
+  if(remote > (_respLen - 7) / 6) {
+    remote = (_respLen - 7) / 6;
+  }
+  if(remote > (FRAMEPOOL_BLOCK_SIZE - 7) / 6) {
+    remote = (FRAMEPOOL_BLOCK_SIZE - 7) / 6;
+  }
+  for(i = 0; i < remote && i < maxnum; i++) {
+    memcpy(entries[i], &_resp[7 + 6*i], 6);
+    num++;
+  }
+  return 0;
 }
 
-void Linkbot::packBufByte(uint8_t byte)
+int Linkbot::moveJoint(int joint, float angle)
 {
-  _buf[_bufsize] = byte;
-  _bufsize++;
+  float _angle;
+  getJointAngle(joint, _angle);
+  moveJointToNB(joint, angle+_angle);
+  moveWait();
+  return 0;
 }
 
-void Linkbot::packBuf(void* data, int size)
+int Linkbot::moveJointNB(int joint, float angle)
 {
-  memcpy(&_buf[_bufsize], data, size);
-  _bufsize += size;
+  float _angle;
+  getJointAngle(joint, _angle);
+  moveJointToNB(joint, angle+_angle);
+  return 0;
 }
 
-void Linkbot::packSimpleCmd(uint8_t cmd)
+int Linkbot::moveJointProfile(int joint, float angle, linkbotMotionProfile_t profile,
+                              float accel, float speed)
 {
-  _buf[0] = cmd;
-  _buf[1] = 3;
-  _buf[2] = 0x00;
-  _bufsize = 3;
+  unsigned long duration;
+  if(moveJointProfileNB(joint, angle, profile, accel, speed, duration)) {
+    return -1;
+  }
+  /* Sleep through the predicted motion before asking the robot */
+  LinkbotScheduler::sleep(duration);
+  return moveWait();
 }
 
-int Linkbot::transactMessage()
+int Linkbot::moveJointProfileNB(int joint, float angle, linkbotMotionProfile_t profile,
+                                float accel, float speed, unsigned long &duration)
 {
-  unsigned long startMillis;
-  static uint8_t buf[256];
-  g_recvBytes = 0;
-  /* First, compose the Link-Layer message */
-  _buf[1] = _bufsize;
-  buf[0] = _buf[0];
-  buf[1] = _buf[1] + 6;
-  buf[2] = _zigbee_addr >> 8;
-  buf[3] = _zigbee_addr & 0x00ff;
-  buf[4] = 1;
-  memcpy(&buf[5], _buf, _bufsize);
-  buf[5+_bufsize] = 0x00;
-  /* Wait for ready state */
-  while(TWI_READY != twi_state) {
-    asm("nop");
+  float _angle;
+  duration = 0;
+  if(speed <= 0) {
+    return -1;
   }
-  startMillis = millis();
-  Serial.write("!\n");
-  twi_writeTo(0x01, buf, _bufsize+6, 1, 1);
-  Serial.write(".\n");
-  /* Wait for a response or a timeout */
-  char sbuf[32];
+  if(getJointAngle(joint, _angle)) {
+    return -1;
+  }
+  duration = motionDuration(profile, angle - _angle, accel, speed);
+  if(profile == PROFILE_CONSTANT || accel <= 0) {
+    if(setJointSpeed(joint, speed)) {
+      return -1;
+    }
+    return moveJointToNB(joint, angle);
+  }
+  /* The firmware has no jerk limit. An S-curve ramp which reaches accel at
+   * its midpoint takes as long as a constant ramp at accel/2, so the
+   * S-curve is approximated by the gentler trapezoid. */
+  if(profile == PROFILE_SCURVE) {
+    accel /= 2;
+  }
+  return smoothMoveJointToNB(joint, angle, accel, accel, speed);
+}
+
+unsigned long Linkbot::motionDuration(linkbotMotionProfile_t profile,
+                                      float distance, float accel, float speed)
+{
+  float t;
+  float rampDistance;
+  distance = fabs(distance);
+  if(speed <= 0) {
+    return 0;
+  }
+  if(profile == PROFILE_CONSTANT || accel <= 0) {
+    return (unsigned long)(distance / speed * 1000.0 + 0.5);
+  }
+  if(profile == PROFILE_SCURVE) {
+    accel /= 2;
+  }
+  /* Distance covered while speeding up to and slowing down from top speed */
+  rampDistance = speed*speed/accel;
+  if(rampDistance <= distance) {
+    t = 2*speed/accel + (distance - rampDistance)/speed;
+  } else {
+    /* Triangular profile: top speed is never reached */
+    t = 2*sqrt(distance/accel);
+  }
+  return (unsigned long)(t * 1000.0 + 0.5);
+}
+
+int Linkbot::move(float angle1, float angle2, float angle3)
+{
+  moveNB(angle1, angle2, angle3);
+  moveWait();
+  return 0;
+}
+
+int Linkbot::moveNB(float angle1, float angle2, float angle3)
+{
+  float a1, a2, a3;
+  getJointAngles(a1, a2, a3);
+  moveToNB(angle1+a1, angle2+a2, angle3+a3);
+  return 0;
+}
+
+int Linkbot::moveToSync(float angle1, float angle2, float angle3, float speed)
+{
+  unsigned long duration;
+  if(moveToSyncNB(angle1, angle2, angle3, speed, duration)) {
+    return -1;
+  }
+  LinkbotScheduler::sleep(duration);
+  return moveWait();
+}
+
+int Linkbot::moveToSyncNB(float angle1, float angle2, float angle3, float speed,
+                          unsigned long &duration)
+{
+  float current[3];
+  float goals[3];
+  float speeds[3];
+  float maxDistance = 0;
+  float t;
+  int i;
+  duration = 0;
+  if(speed <= 0) {
+    return -1;
+  }
+  if(getJointAngles(current[0], current[1], current[2])) {
+    return -1;
+  }
+  goals[0] = angle1;
+  goals[1] = angle2;
+  goals[2] = angle3;
+  for(i = 0; i < 3; i++) {
+    if(fabs(goals[i] - current[i]) > maxDistance) {
+      maxDistance = fabs(goals[i] - current[i]);
+    }
+  }
+  if(maxDistance == 0) {
+    return 0;
+  }
+  /* Every joint covers its own distance in the time the furthest joint
+   * needs at the requested speed */
+  t = maxDistance / speed;
+  for(i = 0; i < 3; i++) {
+    speeds[i] = fabs(goals[i] - current[i]) / t;
+    if(speeds[i] == 0) {
+      speeds[i] = speed;
+    }
+  }
+  if(setJointStates(ROBOT_HOLD, ROBOT_HOLD, ROBOT_HOLD, speeds[0], speeds[1], speeds[2])) {
+    return -1;
+  }
+  duration = (unsigned long)(t * 1000.0 + 0.5);
+  return moveToNB(angle1, angle2, angle3);
+}
+
+int Linkbot::moveWait()
+{
+  int rc;
+  while((rc = isMoving()) > 0) {
+    LinkbotScheduler::sleep(LINKBOT_MOVE_POLL);
+  }
+  return rc;
+}
+
+int Linkbot::pollMoveDone()
+{
+  int moving;
+  int rc;
+  if(!_movePolling) {
+    if((long)(millis() - _movePollAt) < 0) {
+      return 0;
+    }
+    if(requestIsMoving()) {
+      return -1;
+    }
+    _movePolling = 1;
+    return 0;
+  }
+  rc = pollIsMoving(moving);
+  if(rc == 0) {
+    return 0;
+  }
+  _movePolling = 0;
+  if(rc < 0) {
+    return -1;
+  }
+  if(moving) {
+    _movePollAt = millis() + LINKBOT_MOVE_POLL;
+    return 0;
+  }
+  return 1;
+}
+
+int Linkbot::readAddressReport(uint16_t &zigbee_addr, uint8_t serial[4])
+{
+  uint8_t *report;
+  if(g_reportTail == g_reportHead) {
+    serviceLink();
+    return 0;
+  }
+  report = g_reports[g_reportTail];
+  zigbee_addr = ((uint16_t)report[0] << 8) | report[1];
+  memcpy(serial, &report[2], 4);
+  g_reportTail = (g_reportTail + 1) % REPORT_QUEUE_LENGTH;
+  return 1;
+}
+
+int Linkbot::resetToZero()
+{
+  reset();
+  moveTo(0, 0, 0);
+  return 0;
+}
+
+static char prefetchTask(linkbotTask_t *task, void *context)
+{
+  static unsigned long wait;
+  LB_TASK_BEGIN(task);
   while(1) {
-    if(g_recvBytes > 0) {
-        return 0;
+    wait = Linkbot::prefetchService();
+    if(wait == (unsigned long)-1) {
+      break;
+    }
+    if(wait > 0) {
+      LB_TASK_SLEEP(task, wait);
+    } else {
+      LB_TASK_YIELD(task);
+    }
+  }
+  g_prefetchTask = -1;
+  LB_TASK_END(task);
+}
+
+int Linkbot::enablePrefetch(unsigned long interval)
+{
+  prefetchEntry_t *prefetch;
+  if(interval == 0) {
+    return -1;
+  }
+  if((prefetch = findPrefetch(this)) != NULL) {
+    prefetch->interval = interval;
+    return 0;
+  }
+  if((prefetch = findPrefetch(NULL)) == NULL) {
+    return -1;
+  }
+  if(g_prefetchTask < 0) {
+    g_prefetchTask = LinkbotScheduler::add(prefetchTask, NULL);
+    if(g_prefetchTask < 0) {
+      return -1;
+    }
+  }
+  memset(prefetch, 0, sizeof(*prefetch));
+  prefetch->robot = this;
+  prefetch->interval = interval;
+  return 0;
+}
+
+void Linkbot::disablePrefetch()
+{
+  prefetchEntry_t *prefetch = findPrefetch(this);
+  if(prefetch == NULL) {
+    return;
+  }
+  if(prefetch->item && prefetch->txn == _txn) {
+    cancelTransaction();
+  }
+  prefetch->robot = NULL;
+  _cacheValid &= ~CACHE_STALES;
+}
+
+void Linkbot::invalidateShadow()
+{
+  _shadowValid = 0;
+}
+
+int Linkbot::reboot()
+{
+  _shadowValid = 0;
+  _cacheValid = 0;
+  return command(LBCMD_REBOOT);
+}
+
+int Linkbot::reset()
+{
+  _shadowValid = 0;
+  return command(LBCMD_RESETABSCOUNTER);
+}
+
+int Linkbot::setBuzzerFrequency(unsigned int frequency)
+{
+  uint16_t value = frequency;
+  int rc;
+  if(shadowMatches(SHADOW_BUZZER, &_shadowBuzzer, &value, sizeof(value))) {
+    return 0;
+  }
+  rc = command(LBCMD_SETBUZZERFREQUENCY, frequency);
+  shadowUpdate(rc, SHADOW_BUZZER, &_shadowBuzzer, &value, sizeof(value));
+  return rc;
+}
+
+int Linkbot::setJointSpeed(int joint, float speed)
+{
+  uint8_t bit = SHADOW_SPEED1 << (joint - 1);
+  int rc;
+  if(joint < 1 || joint > 3) {
+    return command(LBCMD_SETJOINTSPEED, joint, speed);
+  }
+  if(shadowMatches(bit, &_shadowSpeeds[joint-1], &speed, sizeof(speed))) {
+    return 0;
+  }
+  rc = command(LBCMD_SETJOINTSPEED, joint, speed);
+  shadowUpdate(rc, bit, &_shadowSpeeds[joint-1], &speed, sizeof(speed));
+  return rc;
+}
+
+int Linkbot::setJointState(int joint, int state)
+{
+  uint8_t bit = SHADOW_STATE1 << (joint - 1);
+  uint8_t value = state;
+  int rc;
+  if(joint < 1 || joint > 3) {
+    return command(LBCMD_SETJOINTSTATE, joint, state);
+  }
+  if(shadowMatches(bit, &_shadowStates[joint-1], &value, 1)) {
+    return 0;
+  }
+  rc = command(LBCMD_SETJOINTSTATE, joint, state);
+  shadowUpdate(rc, bit, &_shadowStates[joint-1], &value, 1);
+  return rc;
+}
+
+int Linkbot::setJointStates(int state1, int state2, int state3,
+    float speed1, float speed2, float speed3)
+{
+  uint8_t states[3] = {(uint8_t)state1, (uint8_t)state2, (uint8_t)state3};
+  float speeds[3] = {speed1, speed2, speed3};
+  int rc;
+  if(shadowMatches(SHADOW_STATES, _shadowStates, states, sizeof(states)) &&
+     shadowMatches(SHADOW_SPEEDS, _shadowSpeeds, speeds, sizeof(speeds))) {
+    return 0;
+  }
+  rc = command(LBCMD_SETJOINTSTATES, state1, state2, state3, speed1, speed2, speed3);
+  shadowUpdate(rc, SHADOW_STATES, _shadowStates, states, sizeof(states));
+  shadowUpdate(rc, SHADOW_SPEEDS, _shadowSpeeds, speeds, sizeof(speeds));
+  return rc;
+}
+
+int Linkbot::setLEDColor(uint8_t r, uint8_t g, uint8_t b)
+{
+  prefetchEntry_t *prefetch;
+  uint8_t color[3] = {r, g, b};
+  int rc;
+  if(shadowMatches(SHADOW_LED, _shadowLED, color, sizeof(color))) {
+    return 0;
+  }
+  rc = command(LBCMD_SETLEDCOLOR, r, g, b);
+  shadowUpdate(rc, SHADOW_LED, _shadowLED, color, sizeof(color));
+  if(rc == 0 && (prefetch = findPrefetch(this)) != NULL) {
+    memcpy(prefetch->color, color, sizeof(color));
+    cacheStamp(LB_CACHE_COLOR);
+  } else {
+    _cacheValid &= ~(1 << LB_CACHE_COLOR);
+  }
+  return rc;
+}
+
+void Linkbot::setShadowing(int enable)
+{
+  _shadowing = enable ? 1 : 0;
+  _shadowValid = 0;
+}
+
+unsigned long Linkbot::shadowSuppressed()
+{
+  return _suppressed;
+}
+
+int Linkbot::setJointSpeeds(float speed1, float speed2, float speed3)
+{
+  setJointSpeed(1, speed1);
+  setJointSpeed(2, speed2);
+  setJointSpeed(3, speed3);
+  return 0;
+}
+
+void Linkbot::setBusAddresses(uint8_t slave_addr, uint8_t breakout_addr)
+{
+  g_slaveAddr = slave_addr;
+  LinkbotBus::setAddress(0, breakout_addr);
+  if(g_twiInitialized) {
+    twi_setAddress(g_slaveAddr);
+  }
+}
+
+void Linkbot::setCommandMode(linkbotCommandMode_t mode)
+{
+  beginTwi();
+  g_commandMode = mode;
+}
+
+int Linkbot::setFraming(int enable)
+{
+  _framed = enable ? 1 : 0;
+  /* A colour mask of 0 changes nothing; the values are all bytes that must
+   * be escaped, so the check covers stuffing as well as the CRC */
+  if(_framed && command(LBCMD_FRAMECHECK, 0, 0, 0, MSG_ESCAPE, MSG_ESCAPE, MSG_ESCAPE)) {
+    _framed = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void Linkbot::setResponseMode(linkbotResponseMode_t mode, int readyPin)
+{
+  int i;
+  beginTwi();
+  for(i = 0; i < LinkbotBus::count(); i++) {
+    LinkbotBus::setResponseMode(i, mode, readyPin);
+  }
+}
+
+int Linkbot::stopAll()
+{
+  Linkbot robot(LINKBOT_BROADCAST_ADDR);
+  int rc = 0;
+  g_shadowEpoch++;
+  /* Broadcast over every radio */
+  for(robot._link = 0; robot._link < LinkbotBus::count(); robot._link++) {
+    if(robot.stop()) {
+      rc = -1;
+    }
+  }
+  /* The local robot does not hear its own broadcast */
+  robot._zigbee_addr = 0;
+  robot._link = 0;
+  if(robot.stop()) {
+    rc = -1;
+  }
+  return rc;
+}
+
+int Linkbot::stopGroup(uint16_t group_id)
+{
+  Linkbot robot(LINKBOT_BROADCAST_ADDR);
+  int rc = 0;
+  g_shadowEpoch++;
+  for(robot._link = 0; robot._link < LinkbotBus::count(); robot._link++) {
+    if(robot.command(LBCMD_STOPGROUP, group_id, BTCMD(CMD_STOP), 3)) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+/* The size byte of a command's response, which counts RESP_OK, itself
+ * and RESP_END as well as the response fields. */
+static uint8_t responseSize(const commandDesc_t *desc)
+{
+  uint8_t size = 3;
+  uint8_t i;
+  for(i = 0; i < sizeof(desc->resp) && desc->resp[i] != F_END; i++) {
+    switch(desc->resp[i]) {
+      case F_U8:
+        size += 1;
+        break;
+      case F_U16:
+      case F_ACCEL:
+        size += 2;
+        break;
+      default:
+        size += 4;
+        break;
+    }
+  }
+  return size;
+}
+
+/* Unpack the response to a command from the command table. The variable
+ * arguments are one pointer per response field. */
+void Linkbot::unpackResponse(uint8_t id, va_list *ap)
+{
+  commandDesc_t desc;
+  uint8_t *resp = &_resp[7];
+  uint8_t i;
+  memcpy_P(&desc, &g_commands[id], sizeof(desc));
+  for(i = 0; i < sizeof(desc.resp) && desc.resp[i] != F_END; i++) {
+    switch(desc.resp[i]) {
+      case F_U8:
+        *va_arg(*ap, int*) = *resp++;
+        break;
+      case F_SKIP4:
+        resp += 4;
+        break;
+      case F_ACCEL: {
+        int16_t count = ((uint16_t)resp[0] << 8) | resp[1];
+        *va_arg(*ap, float*) = count / ACCEL_SCALE;
+        resp += 2;
+        break;
+      }
+      case F_U32: {
+        unsigned long *value = va_arg(*ap, unsigned long*);
+        *value = ((unsigned long)resp[0] << 24) | ((unsigned long)resp[1] << 16) |
+                 ((unsigned long)resp[2] << 8) | resp[3];
+        resp += 4;
+        break;
+      }
+      case F_FLOAT:
+      case F_DEG: {
+        float *value = va_arg(*ap, float*);
+        memcpy(value, resp, 4);
+        if(desc.resp[i] == F_DEG) {
+          *value = RAD2DEG(*value);
+        }
+        resp += 4;
+        break;
+      }
+    }
+  }
+}
+
+int Linkbot::uploadPoses(const float poses[][3], int num, float tolerance)
+{
+  int i;
+  int remote;
+  int sent = 0;
+  if(getNumPoses(remote)) {
+    return -1;
+  }
+  for(i = 0; i < num; i++) {
+    /* Only re-send poses which are missing or differ from the robot's copy */
+    if(i < remote) {
+      int rc = poseMatches(i, poses[i], tolerance);
+      if(rc < 0) {
+        return -1;
+      }
+      if(rc) {
+        continue;
+      }
+    }
+    if(driveTo(poses[i][0], poses[i][1], poses[i][2])) {
+      return -1;
+    }
+    if(savePose(i)) {
+      return -1;
+    }
+    sent++;
+  }
+  return sent;
+}
+
+int Linkbot::verifyPoses(const float poses[][3], int num, float tolerance)
+{
+  int i;
+  int remote;
+  int mismatches = 0;
+  if(getNumPoses(remote)) {
+    return -1;
+  }
+  if(remote < num) {
+    mismatches += num - remote;
+    num = remote;
+  }
+  for(i = 0; i < num; i++) {
+    int rc = poseMatches(i, poses[i], tolerance);
+    if(rc < 0) {
+      return -1;
     }
-    if((millis() - startMillis) > 500) {
-      sprintf(sbuf, "timeout: %lu %lu\n", millis(), startMillis);
-      Serial.write(sbuf);
+    if(!rc) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+int Linkbot::waitAll(Linkbot *robots[], int num)
+{
+  int i;
+  /* More robots than waitMany() follows at once are waited on a batch at
+   * a time */
+  for(i = 0; i < num; i += LINKBOT_MAX_WAIT) {
+    if(waitMany(&robots[i], (num - i < LINKBOT_MAX_WAIT) ? num - i : LINKBOT_MAX_WAIT, 0)) {
       return -1;
     }
   }
   return 0;
 }
+
+int Linkbot::waitAny(Linkbot *robots[], int num)
+{
+  if(num > LINKBOT_MAX_WAIT) {
+    return -1;
+  }
+  return waitMany(robots, num, 1);
+}
+
+/* Pack, send and unpack a command from the command table. The variable
+ * arguments are the command's argument fields in order, followed by one
+ * pointer per response field. */
+int Linkbot::command(uint8_t id, ...)
+{
+  va_list ap;
+  uint8_t flags = pgm_read_byte(&g_commands[id].flags);
+  int rc;
+  va_start(ap, id);
+  packCommand(id, &ap);
+  if(flags & CF_URGENT) {
+    va_end(ap);
+    return sendUrgent(!(flags & CF_GROUP));
+  }
+  if(flags & CF_NORESPONSE) {
+    va_end(ap);
+    return sendMessage();
+  }
+  rc = transactMessage();
+  if(rc == 0) {
+    unpackResponse(id, &ap);
+  }
+  va_end(ap);
+  return rc;
+}
+
+/* Pack and send a command from the command table without waiting for the
+ * response; commandPoll() collects it. The variable arguments are the
+ * command's argument fields. */
+int Linkbot::commandNB(uint8_t id, ...)
+{
+  va_list ap;
+  va_start(ap, id);
+  packCommand(id, &ap);
+  va_end(ap);
+  return beginTransaction();
+}
+
+/* Collect the response to commandNB(). The variable arguments are one
+ * pointer per response field. Returns 1 once they are filled in, 0 while
+ * the response is still on its way, or -1 if none will come. */
+int Linkbot::commandPoll(uint8_t id, ...)
+{
+  va_list ap;
+  int rc = pollTransaction();
+  if(rc > 0 && _framed && checkFrame()) {
+    linkStatAdd(&g_links[_link].stats.badFrames, 1);
+    releaseResponse();
+    rc = -1;
+  }
+  if(rc > 0) {
+    va_start(ap, id);
+    unpackResponse(id, &ap);
+    va_end(ap);
+  }
+  return rc;
+}
+
+void Linkbot::packBufReset()
+{
+  if(_buf == NULL) {
+    _buf = framepool_borrow();
+  }
+  _bufsize = 0;
+  _expect = 0;
+}
+
+void Linkbot::packBufByte(uint8_t byte)
+{
+  packBuf(&byte, 1);
+}
+
+void Linkbot::packBuf(void* data, int size)
+{
+  /* Keep room for the link-layer terminator */
+  if((_buf == NULL) || (LINK_HEADER_SIZE + _bufsize + size >= FRAMEPOOL_BLOCK_SIZE)) {
+    _bufsize = PACK_OVERFLOW;
+    return;
+  }
+  memcpy(&_buf[LINK_HEADER_SIZE + _bufsize], data, size);
+  _bufsize += size;
+}
+
+void Linkbot::packSimpleCmd(uint8_t cmd)
+{
+  packBufReset();
+  packBufByte(cmd);
+  packBufByte(3);
+  packBufByte(0x00);
+}
+
+void Linkbot::getLinkStats(linkbotLinkStats_t &stats)
+{
+  linkbotLinkStats_t link;
+  twi_stats_t bus;
+  int i;
+  /* Sum the links */
+  memset(&stats, 0, sizeof(stats));
+  for(i = 0; i < LinkbotBus::count(); i++) {
+    LinkbotBus::getLinkStats(i, link);
+    stats.transactions += link.transactions;
+    stats.timeouts += link.timeouts;
+    stats.rttTotal += link.rttTotal;
+    if(link.rttMax > stats.rttMax) {
+      stats.rttMax = link.rttMax;
+    }
+    stats.busBytes += link.busBytes;
+    stats.polls += link.polls;
+    stats.badFrames += link.badFrames;
+  }
+  twi_getStats(&bus);
+  stats.arbLost = bus.arbLost;
+  stats.arbRetries = bus.retries;
+  stats.arbDropped = bus.dropped;
+  stats.busYields = bus.yields;
+}
+
+int Linkbot::framePoolHighWater()
+{
+  return framepool_highWater();
+}
+
+unsigned long Linkbot::urgentLatencyMax()
+{
+  return g_urgentLatencyMax;
+}
+
+/* Pack a command from the command table. The variable arguments are the
+ * command's argument fields in order. */
+void Linkbot::packCommand(uint8_t id, va_list *ap)
+{
+  commandDesc_t desc;
+  float degrees[3];
+  uint8_t numDegrees = 0;
+  uint8_t joint = 0;
+  uint8_t i;
+  memcpy_P(&desc, &g_commands[id], sizeof(desc));
+  /* Urgent commands may take the pool's last block, so that they cannot
+   * fail for lack of one */
+  if(desc.flags & CF_URGENT) {
+    framepool_return(_buf);
+    _buf = framepool_borrowUrgent();
+  }
+  packBufReset();
+  packBufByte(desc.cmd);
+  packBufByte(0x00);
+  for(i = 0; i < sizeof(desc.args) && desc.args[i] != F_END; i++) {
+    switch(desc.args[i]) {
+      case F_U8: {
+        uint8_t value = va_arg(*ap, int);
+        if(i == 0) {
+          joint = value;
+        }
+        packBufByte(value);
+        break;
+      }
+      case F_U16: {
+        unsigned int value = va_arg(*ap, unsigned int);
+        packBufByte(value >> 8);
+        packBufByte(value & 0x00ff);
+        break;
+      }
+      case F_U32: {
+        unsigned long value = va_arg(*ap, unsigned long);
+        packBufByte(value >> 24);
+        packBufByte(value >> 16);
+        packBufByte(value >> 8);
+        packBufByte(value & 0x00ff);
+        break;
+      }
+      case F_FLOAT:
+      case F_DEG: {
+        float value = va_arg(*ap, double);
+        if(desc.args[i] == F_DEG) {
+          if(numDegrees < 3) {
+            degrees[numDegrees++] = value;
+          }
+          value = DEG2RAD(value);
+        }
+        packBuf(&value, 4);
+        break;
+      }
+      case F_ZERO:
+        packBufByte(0x00);
+        break;
+      case F_FF:
+        packBufByte(0xff);
+        break;
+      case F_PAD4:
+        if(_buf != NULL && _bufsize >= 4 && _bufsize != PACK_OVERFLOW) {
+          packBuf(&_buf[LINK_HEADER_SIZE + _bufsize - 4], 4);
+        }
+        break;
+    }
+  }
+  packBufByte((desc.flags & CF_GROUP) ? GRP_CMD_END : 0x00);
+  if(joint < 1 || joint > 3) {
+    joint = 0;
+  }
+  /* A motion command leaves the states and goals of the joints it moves
+   * unknown; one naming a single joint leaves the other two alone. The
+   * shadowed setters record their own bits again once the robot answers. */
+  if(desc.flags & CF_MOTION) {
+    uint8_t joints = ((desc.flags & CF_JOINT) && joint) ? 1 << (joint-1) : 0x07;
+    _shadowValid &= ~(joints * SHADOW_STATE1);
+    _goalValid &= ~joints;
+    _motionAt = millis();
+  }
+  /* LinkbotSetpointStream sets speeds without going through
+   * setJointSpeed(), so forget the one joint's speed being sent */
+  if(id == LBCMD_SETJOINTSPEED && joint) {
+    _shadowValid &= ~(SHADOW_SPEED1 << (joint-1));
+  }
+  /* Remember where the joints were sent, for LinkbotEstimator */
+  if(id == LBCMD_MOVETO || id == LBCMD_DRIVETO) {
+    memcpy(_goals, degrees, sizeof(_goals));
+    _goalValid = 0x07;
+  } else if((id == LBCMD_MOVEJOINTTO || id == LBCMD_DRIVEJOINTTO) && joint) {
+    _goals[joint-1] = degrees[0];
+    _goalValid |= 1 << (joint-1);
+  }
+  /* matchSlot() assumes the firmware sends at least the fields listed in
+   * the command table; a longer response is accepted, a shorter one is
+   * not. tests/command_sizes checks the table against commands.h. */
+  _expect = responseSize(&desc);
+}
+
+int Linkbot::poseMatches(int index, const float pose[3], float tolerance)
+{
+  float remote[3];
+  int i;
+  if(getPoseData(index, remote[0], remote[1], remote[2])) {
+    return -1;
+  }
+  for(i = 0; i < 3; i++) {
+    if(fabs(remote[i] - pose[i]) > tolerance) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int Linkbot::readRegisters(uint8_t reg, uint8_t *data, uint8_t num)
+{
+  uint8_t buf[2];
+  beginTwi();
+  buf[0] = MSG_REGACCESS;
+  buf[1] = reg;
+  return twi_writeRead(g_links[0].addr, buf, 2, data, num) ? -1 : 0;
+}
+
+void Linkbot::resetLinkStats()
+{
+  int i;
+  for(i = 0; i < LinkbotBus::count(); i++) {
+    LinkbotBus::resetLinkStats(i);
+  }
+  twi_resetStats();
+}
+
+/* Check whether nothing is waiting on any link: no transaction, no
+ * transfer queued and no frame waiting to be pulled */
+int Linkbot::linkIdle()
+{
+  int i;
+  for(i = 0; i < MAX_PENDING; i++) {
+    if(g_pending[i].state != SLOT_FREE) {
+      return 0;
+    }
+  }
+  return twi_pending() == 0 && g_outboxCount == 0;
+}
+
+/* Fetch one stale value for a robot which prefetches, when the links are
+ * idle, and collect it. Returns how long until it is worth looking again,
+ * in milliseconds, or -1 if no robot prefetches any more. */
+unsigned long Linkbot::prefetchService()
+{
+  static const uint8_t ids[LB_CACHE_NUMITEMS] = {
+    LBCMD_GETBATTERYVOLTAGE, LBCMD_GETFORMFACTOR, LBCMD_GETHWREV,
+    LBCMD_GETVERSION, LBCMD_GETRGB };
+  prefetchEntry_t *prefetch;
+  Linkbot *robot;
+  int values[3];
+  float volts;
+  int registered = 0;
+  int item;
+  int rc;
+  int i;
+  for(i = 0; i < LINKBOT_MAX_PREFETCH; i++) {
+    prefetch = &g_prefetch[i];
+    robot = prefetch->robot;
+    if(robot == NULL) {
+      continue;
+    }
+    registered++;
+    if(prefetch->item == 0) {
+      continue;
+    }
+    /* A command sent on the robot since abandons the read */
+    if(prefetch->txn != robot->_txn) {
+      prefetch->item = 0;
+      continue;
+    }
+    item = prefetch->item - 1;
+    if(item == LB_CACHE_BATTERY) {
+      rc = robot->commandPoll(ids[item], &volts);
+    } else {
+      rc = robot->commandPoll(ids[item], &values[0], &values[1], &values[2]);
+    }
+    if(rc == 0) {
+      return 0;
+    }
+    prefetch->item = 0;
+    if(rc < 0) {
+      continue;
+    }
+    switch(item) {
+      case LB_CACHE_BATTERY: prefetch->battery = volts; break;
+      case LB_CACHE_FORMFACTOR: robot->_cacheFormFactor = values[0]; break;
+      case LB_CACHE_HWREV: robot->_cacheHwRev = values[0]; break;
+      case LB_CACHE_VERSION: robot->_cacheVersion = values[0]; break;
+      case LB_CACHE_COLOR:
+        prefetch->color[0] = values[0];
+        prefetch->color[1] = values[1];
+        prefetch->color[2] = values[2];
+        break;
+    }
+    robot->cacheStamp((linkbotCacheItem_t)item);
+  }
+  if(registered == 0) {
+    return (unsigned long)-1;
+  }
+  /* Only housekeeping of our own is on the bus from here on, one read at a
+   * time, and only when nothing else is */
+  if(!linkIdle()) {
+    return PREFETCH_POLL;
+  }
+  for(i = 0; i < LINKBOT_MAX_PREFETCH; i++) {
+    prefetch = &g_prefetch[i];
+    robot = prefetch->robot;
+    if(robot == NULL || robot->_slot != NULL) {
+      continue;
+    }
+    for(item = 0; item < LB_CACHE_NUMITEMS; item++) {
+      if(!(robot->_cacheValid & (1 << item)) ||
+         ((CACHE_STALES & (1 << item)) &&
+          (millis() - prefetch->at[item]) >= prefetch->interval)) {
+        break;
+      }
+    }
+    if(item == LB_CACHE_NUMITEMS) {
+      continue;
+    }
+    if(robot->commandNB(ids[item]) == 0) {
+      prefetch->item = item + 1;
+      prefetch->txn = robot->_txn;
+      return 0;
+    }
+  }
+  return PREFETCH_POLL;
+}
+
+/* Check on the transaction begun by beginTransaction(). Returns 1 once the
+ * response is in _resp, 0 while it is still on its way, or -1 if none will
+ * come. */
+int Linkbot::pollTransaction()
+{
+  pendingResponse_t *slot = (pendingResponse_t*)_slot;
+  unsigned long rtt;
+  uint8_t sreg;
+  int rc = -1;
+  if(slot == NULL) {
+    return -1;
+  }
+  if(slot->state == SLOT_DONE) {
+    _resp = slot->frame;
+    _respLen = slot->length;
+    slot->frame = NULL;
+    rtt = micros() - _startMicros;
+    sreg = SREG;
+    cli();
+    g_links[_link].stats.transactions++;
+    g_links[_link].stats.rttTotal += rtt;
+    if(rtt > g_links[_link].stats.rttMax) {
+      g_links[_link].stats.rttMax = rtt;
+    }
+    SREG = sreg;
+    rc = 1;
+  } else if(slot->state == SLOT_ABORTED) {
+    dprint("aborted\n");
+  } else if(slot->error != TWI_NO_ERROR) {
+    /* The frame never reached the breakout board; don't wait for a
+     * response which cannot come */
+    dprint("send failed\n");
+  } else if((millis() - _start) > RESPONSE_TIMEOUT) {
+    dprint("timeout: ");
+    dprintnum(millis() - _start);
+    dprint("\n");
+    linkStatAdd(&g_links[_link].stats.timeouts, 1);
+    /* The robot may have rebooted, or taken the command without the
+     * response getting back */
+    _shadowValid = 0;
+  } else {
+    serviceLink();
+    return 0;
+  }
+  releaseSlot(slot);
+  _slot = NULL;
+  return rc;
+}
+
+/* Check whether the robot already has a setting, so the command to set it
+ * can be skipped. bits are the shadow's bits in _shadowValid; all must be
+ * set. */
+int Linkbot::shadowMatches(uint8_t bits, const void *shadow, const void *value, uint8_t size)
+{
+  if(_shadowEpoch != g_shadowEpoch) {
+    _shadowEpoch = g_shadowEpoch;
+    _shadowValid = 0;
+  }
+  if(!_shadowing || (_shadowValid & bits) != bits || memcmp(shadow, value, size)) {
+    return 0;
+  }
+  _suppressed++;
+  return 1;
+}
+
+/* Record the outcome of a command setting a shadowed setting. If the robot
+ * did not acknowledge it, the setting is no longer known. */
+void Linkbot::shadowUpdate(int rc, uint8_t bits, void *shadow, const void *value, uint8_t size)
+{
+  if(rc) {
+    _shadowValid &= ~bits;
+    return;
+  }
+  memcpy(shadow, value, size);
+  _shadowValid |= bits;
+}
+
+void Linkbot::releaseResponse()
+{
+  framepool_return(_resp);
+  _resp = NULL;
+}
+
+/* Send the packed command without waiting for a response. If error is
+ * given, it is set to the outcome of the send once the frame has left. */
+int Linkbot::sendMessage(volatile uint8_t *error)
+{
+  unsigned long startMillis;
+  uint8_t *buf = takeFrame();
+  uint8_t rc;
+  if(buf == NULL) {
+    return -1;
+  }
+  /* The robot takes the frame when it is ready; nothing waits on the bus.
+   * Only link 0's breakout board pulls. */
+  if(g_commandMode == LINKBOT_COMMAND_PULL && _link == 0) {
+    return queueFrame(buf);
+  }
+  /* Queue the frame and let the TWI interrupt clock it out. If the queue is
+   * full, wait for the transfers ahead of us to drain. */
+  startMillis = millis();
+  while((rc = twi_writeToAsync(g_links[_link].addr, buf, _bufsize+6, 1, onSendComplete, (void*)error)) != 0) {
+    if((millis() - startMillis) > SEND_QUEUE_TIMEOUT) {
+      break;
+    }
+    twi_service();
+    LinkbotScheduler::yield();
+  }
+  framepool_return(buf);
+  if(rc == 0) {
+    linkStatAdd(&g_links[_link].stats.busBytes, _bufsize + 7);
+  }
+  return rc ? -1 : 0;
+}
+
+/* Send the packed command ahead of everything queued, once the transfer on
+ * the bus ends. Transactions waiting on the robot are aborted, since the
+ * robot's response to this command would otherwise be taken for theirs.
+ * Other tasks are not run meanwhile. */
+int Linkbot::sendUrgent(uint8_t answered)
+{
+  unsigned long startMicros = micros();
+  unsigned long elapsed;
+  pendingResponse_t *slot = NULL;
+  uint8_t *buf = takeFrame();
+  uint8_t sreg;
+  uint8_t rc;
+  if(buf == NULL) {
+    return -1;
+  }
+  abortSlots(_zigbee_addr);
+  /* The robot still answers with RESP_OK. Nobody waits for it, so an
+   * orphan slot swallows it before a transaction begun after the stop can
+   * take it for its own. Best effort: with every slot taken, the answer
+   * goes unclaimed. */
+  if(answered && _zigbee_addr != LINKBOT_BROADCAST_ADDR) {
+    slot = claimSlot(_zigbee_addr, 3);
+  }
+  /* Only one urgent frame may be queued; wait for the one before us */
+  do {
+    sreg = SREG;
+    cli();
+    rc = twi_writeToUrgent(g_links[_link].addr, buf, _bufsize+6, 1, onSendComplete, (void*)&g_urgentStatus);
+    if(rc == 0) {
+      g_urgentStatus = URGENT_PENDING;
+    }
+    SREG = sreg;
+  } while(rc != 0 && (micros() - startMicros) < LINKBOT_URGENT_TIMEOUT * 1000UL);
+  if(rc != 0) {
+    /* The TWI layer only takes the frame over once it is queued */
+    framepool_return(buf);
+    if(slot != NULL) {
+      releaseSlot(slot);
+    }
+    return -1;
+  }
+  while(g_urgentStatus == URGENT_PENDING) {
+    twi_service();
+    if((micros() - startMicros) >= LINKBOT_URGENT_TIMEOUT * 1000UL) {
+      dprint("urgent timeout\n");
+      break;
+    }
+  }
+  if(slot != NULL) {
+    slot->error = (g_urgentStatus == URGENT_PENDING) ? TWI_NO_ERROR : g_urgentStatus;
+    orphanSlot(slot);
+  }
+  if(g_urgentStatus == URGENT_PENDING) {
+    return -1;
+  }
+  elapsed = micros() - startMicros;
+  if(elapsed > g_urgentLatencyMax) {
+    g_urgentLatencyMax = elapsed;
+  }
+  return (g_urgentStatus == TWI_NO_ERROR) ? 0 : -1;
+}
+
+/* Compose the Link-Layer message around the packed command and take the
+ * frame from the pack buffer. Returns NULL if the command did not fit. */
+uint8_t* Linkbot::takeFrame()
+{
+  uint8_t *buf = _buf;
+  if(_link == LINK_UNASSIGNED) {
+    _link = LinkbotBus::assign(_zigbee_addr);
+  }
+  if(buf == NULL) {
+    return NULL;
+  }
+  _buf = NULL;
+  if(_bufsize == PACK_OVERFLOW) {
+    framepool_return(buf);
+    return NULL;
+  }
+  if(_framed && _bufsize >= 3) {
+    uint8_t *msg = &buf[LINK_HEADER_SIZE];
+    uint8_t n;
+    /* The CRC takes the terminator's place; the arguments and CRC are then
+     * stuffed in place and a new terminator added */
+    msg[_bufsize - 1] = framing_crc8(framing_crc8(0, msg, 1), &msg[2], _bufsize - 3);
+    n = framing_stuff(&msg[2], _bufsize - 2,
+                      FRAMEPOOL_BLOCK_SIZE - LINK_HEADER_SIZE - 4);
+    if(n == 0) {
+      /* Arguments with several MSG_ESCAPE bytes may not fit a TWI frame */
+      dprint("too long to frame\n");
+      framepool_return(buf);
+      return NULL;
+    }
+    msg[n + 2] = 0x00;
+    _bufsize = n + 3;
+  }
+  buf[LINK_HEADER_SIZE + 1] = _bufsize;
+  buf[0] = buf[LINK_HEADER_SIZE];
+  buf[1] = _bufsize + 6;
+  buf[2] = _zigbee_addr >> 8;
+  buf[3] = _zigbee_addr & 0x00ff;
+  buf[4] = 1;
+  buf[LINK_HEADER_SIZE + _bufsize] = 0x00;
+  return buf;
+}
+
+int Linkbot::transactMessage()
+{
+  /* The packed command, kept unframed for sending again */
+  uint8_t saved[FRAMEPOOL_BLOCK_SIZE - LINK_HEADER_SIZE];
+  uint8_t savedSize = _bufsize;
+  int attempt;
+  int rc;
+  if(!_framed || _buf == NULL || _bufsize > sizeof(saved)) {
+    return transactOnce();
+  }
+  memcpy(saved, &_buf[LINK_HEADER_SIZE], savedSize);
+  for(attempt = 0; ; attempt++) {
+    rc = transactOnce();
+    if(rc || checkFrame() == 0) {
+      return rc;
+    }
+    dprint("bad frame\n");
+    linkStatAdd(&g_links[_link].stats.badFrames, 1);
+    releaseResponse();
+    if(attempt >= LINKBOT_FRAME_RETRIES) {
+      return -1;
+    }
+    /* Send again at once rather than waiting for a timeout */
+    _buf = framepool_borrow();
+    if(_buf == NULL) {
+      return -1;
+    }
+    memcpy(&_buf[LINK_HEADER_SIZE], saved, savedSize);
+    _bufsize = savedSize;
+  }
+}
+
+int Linkbot::transactOnce()
+{
+  int rc;
+  if(beginTransaction()) {
+    return -1;
+  }
+  /* Wait for a response or a timeout, letting other tasks run meanwhile */
+  while((rc = pollTransaction()) == 0) {
+    LinkbotScheduler::yield();
+  }
+  return (rc > 0) ? 0 : -1;
+}
+
+/* Wait for all or any of the robots to stop moving. The robots share one
+ * polling loop: each is asked whether it is moving only when it is due, and
+ * a robot which is still moving is asked how far its motors are from their
+ * goals. From how quickly that distance shrinks, the robot is next asked
+ * shortly before it should arrive. Returns 0 once all have stopped, the
+ * index of the first robot to stop if any is set, or -1 on failure. num
+ * may be at most LINKBOT_MAX_WAIT. */
+int Linkbot::waitMany(Linkbot *robots[], int num, int any)
+{
+  waitRobot_t waits[LINKBOT_MAX_WAIT];
+  waitRobot_t *wait;
+  Linkbot *robot;
+  float errors[4];
+  float error;
+  unsigned long now;
+  unsigned long interval;
+  int inflight = 0;
+  int done = 0;
+  int moving;
+  int result = -2;
+  int rc;
+  int i;
+  if(num <= 0) {
+    return any ? -1 : 0;
+  }
+  for(i = 0; i < num; i++) {
+    waits[i].state = WAIT_IDLE;
+    waits[i].next = millis();
+    waits[i].error = -1;
+  }
+  while(result == -2) {
+    for(i = 0; i < num && result == -2; i++) {
+      robot = robots[i];
+      wait = &waits[i];
+      switch(wait->state) {
+        case WAIT_IDLE:
+          /* Don't hold more slots than there are, or the responses which
+           * would free them can't be collected */
+          if(inflight >= MAX_PENDING ||
+             (long)(millis() - wait->next) < 0) {
+            break;
+          }
+          if(robot->commandNB(LBCMD_ISMOVING)) {
+            result = -1;
+            break;
+          }
+          inflight++;
+          wait->state = WAIT_MOVING;
+          break;
+        case WAIT_MOVING:
+          rc = robot->commandPoll(LBCMD_ISMOVING, &moving);
+          if(rc == 0) {
+            break;
+          }
+          inflight--;
+          if(rc < 0) {
+            result = -1;
+            break;
+          }
+          if(!moving) {
+            wait->state = WAIT_DONE;
+            done++;
+            if(any) {
+              result = i;
+            }
+            break;
+          }
+          if(robot->commandNB(LBCMD_GETMOTORERRORS)) {
+            wait->next = millis() + WAIT_INTERVAL;
+            wait->state = WAIT_IDLE;
+            break;
+          }
+          inflight++;
+          wait->state = WAIT_ERRORS;
+          break;
+        case WAIT_ERRORS:
+          rc = robot->commandPoll(LBCMD_GETMOTORERRORS,
+              &errors[0], &errors[1], &errors[2], &errors[3]);
+          if(rc == 0) {
+            break;
+          }
+          inflight--;
+          now = millis();
+          interval = WAIT_INTERVAL;
+          if(rc > 0) {
+            error = fabs(errors[0]);
+            if(fabs(errors[1]) > error) {
+              error = fabs(errors[1]);
+            }
+            if(fabs(errors[2]) > error) {
+              error = fabs(errors[2]);
+            }
+            /* Continuous motions have no goal to close in on, so only a
+             * shrinking error says when the robot will arrive */
+            if(wait->error > error && now != wait->at) {
+              interval = (unsigned long)(0.75 * error * (now - wait->at) /
+                  (wait->error - error));
+              if(interval < WAIT_INTERVAL_MIN) {
+                interval = WAIT_INTERVAL_MIN;
+              } else if(interval > WAIT_INTERVAL_MAX) {
+                interval = WAIT_INTERVAL_MAX;
+              }
+            }
+            wait->error = error;
+            wait->at = now;
+          }
+          wait->next = now + interval;
+          wait->state = WAIT_IDLE;
+          break;
+      }
+    }
+    if(result == -2 && done == num) {
+      result = 0;
+    }
+    if(result == -2) {
+      LinkbotScheduler::yield();
+    }
+  }
+  /* Forget the questions still out to robots nobody waits on any more */
+  for(i = 0; i < num; i++) {
+    if(waits[i].state == WAIT_MOVING || waits[i].state == WAIT_ERRORS) {
+      robots[i]->cancelTransaction();
+    }
+  }
+  return result;
+}
+
+int Linkbot::writeRegisters(uint8_t reg, const uint8_t *data, uint8_t num)
+{
+  uint8_t buf[TWI_BUFFER_LENGTH];
+  if(num > TWI_BUFFER_LENGTH - 2) {
+    return -1;
+  }
+  beginTwi();
+  buf[0] = MSG_REGACCESS;
+  buf[1] = reg;
+  memcpy(&buf[2], data, num);
+  return twi_writeTo(g_links[0].addr, buf, num + 2, 1, 1) ? -1 : 0;
+}
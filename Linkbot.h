@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
 /**
  * Possible robot joint states
@@ -19,6 +20,122 @@ typedef enum robotJointState_e
     ROBOT_ACCEL,
 } robotJointState_t;
 
+/* The longest stop(), powerOff() and the other urgent commands may take to
+ * get on the bus, in milliseconds. They fail if the bound is missed. */
+#ifndef LINKBOT_URGENT_TIMEOUT
+#define LINKBOT_URGENT_TIMEOUT 20
+#endif
+
+/* The most robots which may prefetch at once, and how often a robot's
+ * battery voltage and LED color are refreshed by default, in milliseconds */
+#ifndef LINKBOT_MAX_PREFETCH
+#define LINKBOT_MAX_PREFETCH 4
+#endif
+#ifndef LINKBOT_PREFETCH_INTERVAL
+#define LINKBOT_PREFETCH_INTERVAL 10000
+#endif
+
+/* The most robots waitAny() takes, and that waitAll() follows at once */
+#ifndef LINKBOT_MAX_WAIT
+#define LINKBOT_MAX_WAIT 8
+#endif
+
+/**
+ * The values kept by a robot's cache. */
+typedef enum linkbotCacheItem_e
+{
+  LB_CACHE_BATTERY,
+  LB_CACHE_FORMFACTOR,
+  LB_CACHE_HWREV,
+  LB_CACHE_VERSION,
+  LB_CACHE_COLOR,
+  LB_CACHE_NUMITEMS
+} linkbotCacheItem_t;
+
+/* Zigbee address heard by every robot in range */
+#define LINKBOT_BROADCAST_ADDR 0xFFFF
+
+/* How often to ask the breakout board for a response in
+ * LINKBOT_RESPONSE_POLL mode without a ready pin, in milliseconds */
+#ifndef LINKBOT_POLL_INTERVAL
+#define LINKBOT_POLL_INTERVAL 5
+#endif
+
+/**
+ * How responses get back from the robot.
+ * LINKBOT_RESPONSE_SLAVE: the breakout board becomes bus master and writes
+ * the response to the Arduino, which listens as TWI slave 0x02.
+ * LINKBOT_RESPONSE_POLL: the Arduino stays bus master and reads the
+ * response from the breakout board, either when the board pulls a ready pin
+ * low or every LINKBOT_POLL_INTERVAL milliseconds. The breakout board's
+ * firmware must hold responses to be read. */
+typedef enum linkbotResponseMode_e
+{
+  LINKBOT_RESPONSE_SLAVE,
+  LINKBOT_RESPONSE_POLL,
+} linkbotResponseMode_t;
+
+/**
+ * How commands get to the robot.
+ * LINKBOT_COMMAND_PUSH: the Arduino becomes bus master and writes each
+ * command to the breakout board as it is issued.
+ * LINKBOT_COMMAND_PULL: commands are queued on the Arduino and the breakout
+ * board reads them from slave 0x02 when it is ready for more; a read finds
+ * MSG_SENDEND when the queue is empty. Urgent commands such as stop() are
+ * always pushed. */
+typedef enum linkbotCommandMode_e
+{
+  LINKBOT_COMMAND_PUSH,
+  LINKBOT_COMMAND_PULL,
+} linkbotCommandMode_t;
+
+/* The most commands queued for the robot to pull */
+#ifndef LINKBOT_OUTBOX_LENGTH
+#define LINKBOT_OUTBOX_LENGTH 3
+#endif
+
+/**
+ * Link statistics, for comparing the response modes. Times are in
+ * microseconds. busBytes counts every byte clocked over the bus, including
+ * polls which found no response. */
+typedef struct linkbotLinkStats_s
+{
+  unsigned long transactions; /* transactions which got a response */
+  unsigned long timeouts;     /* transactions which did not */
+  unsigned long rttTotal;     /* summed round-trip time of transactions */
+  unsigned long rttMax;       /* longest round-trip time */
+  unsigned long busBytes;
+  unsigned long polls;        /* reads issued in LINKBOT_RESPONSE_POLL mode */
+  unsigned long badFrames;    /* framed responses which failed their CRC */
+  /* Sharing the bus with other masters */
+  unsigned int arbLost;       /* arbitrations lost */
+  unsigned int arbRetries;    /* transfers retried after a loss */
+  unsigned int arbDropped;    /* transfers given up after too many losses */
+  unsigned int busYields;     /* pauses made to let other masters in */
+} linkbotLinkStats_t;
+
+/* How many times a framed command whose response fails its CRC is sent
+ * again before giving up */
+#ifndef LINKBOT_FRAME_RETRIES
+#define LINKBOT_FRAME_RETRIES 2
+#endif
+
+/* How often, in milliseconds, moveWait() and pollMoveDone() ask a robot
+ * whether it is still moving */
+#ifndef LINKBOT_MOVE_POLL
+#define LINKBOT_MOVE_POLL 100
+#endif
+
+/* Default TWI addresses of the Arduino and of the breakout board it talks
+ * to. Several Arduinos sharing one bus need distinct addresses; see
+ * Linkbot::setBusAddresses(). */
+#ifndef LINKBOT_SLAVE_ADDR
+#define LINKBOT_SLAVE_ADDR 0x02
+#endif
+#ifndef LINKBOT_BREAKOUT_ADDR
+#define LINKBOT_BREAKOUT_ADDR 0x01
+#endif
+
 typedef enum mobotFormFactor_e
 {
   MOBOTFORM_NULL,
@@ -28,6 +145,67 @@ typedef enum mobotFormFactor_e
   MOBOTFORM_T,
 }mobotFormFactor_t;
 
+/**
+ * Motion profiles
+ * These values select the velocity profile used by the smooth motion
+ * functions, such as Linkbot.moveJointProfile(). */
+typedef enum linkbotMotionProfile_e
+{
+    PROFILE_CONSTANT = 0, /* Constant speed, no acceleration limit */
+    PROFILE_TRAPEZOID,    /* Constant acceleration up to the top speed */
+    PROFILE_SCURVE,       /* Gradual acceleration with no step in torque */
+} linkbotMotionProfile_t;
+
+
+/*
+ * Command descriptor ids
+ * Each id selects an entry of the PROGMEM command table in Linkbot.cpp, which
+ * describes how the command's arguments are packed and its response is
+ * unpacked. */
+typedef enum linkbotCommandId_e
+{
+    LBCMD_STATUS = 0,
+    LBCMD_CLEARQUERIEDADDRESSES,
+    LBCMD_DRIVEJOINTTO,
+    LBCMD_DRIVETO,
+    LBCMD_GETACCEL,
+    LBCMD_GETBATTERYVOLTAGE,
+    LBCMD_GETFORMFACTOR,
+    LBCMD_GETHWREV,
+    LBCMD_GETJOINTANGLES,
+    LBCMD_GETJOINTANGLESTIMESTAMP,
+    LBCMD_GETMOTORERRORS,
+    LBCMD_GETNUMPOSES,
+    LBCMD_GETPOSEDATA,
+    LBCMD_GETRGB,
+    LBCMD_GETVERSION,
+    LBCMD_ISMOVING,
+    LBCMD_MOVEJOINTTO,
+    LBCMD_MOVETO,
+    LBCMD_MOVETOPOSE,
+    LBCMD_PLAYPOSES,
+    LBCMD_POWEROFF,
+    LBCMD_QUERYADDRESSES,
+    LBCMD_REBOOT,
+    LBCMD_RESETABSCOUNTER,
+    LBCMD_SAVEPOSE,
+    LBCMD_SETBUZZERFREQUENCY,
+    LBCMD_SETGROUP,
+    LBCMD_SETGROUPMASTER,
+    LBCMD_SETGLOBALACCEL,
+    LBCMD_SETACCEL,
+    LBCMD_SETJOINTSPEED,
+    LBCMD_SETJOINTSTATE,
+    LBCMD_SETJOINTSTATES,
+    LBCMD_SETLEDCOLOR,
+    LBCMD_SETMOTORPOWER,
+    LBCMD_SETMOTORPOWERNB,
+    LBCMD_SMOOTHMOVE,
+    LBCMD_STOP,
+    LBCMD_STOPGROUP,
+    LBCMD_FRAMECHECK,
+    LBCMD_NUMCOMMANDS
+} linkbotCommandId_t;
 
 /** 
  * The Linkbot Class. 
@@ -87,28 +265,63 @@ class Linkbot {
     /**
      * Check to see if the Linkbot is responding. Returns 0 on success.
      */
-    int checkStatus();
+    int checkStatus() { return command(LBCMD_STATUS); }
+
+    /**
+     * Check the status of several robots at once. A status request is sent to
+     * every address before any response is awaited, so the whole sweep takes
+     * about one round trip rather than one per robot. alive[i] is set to 1 if
+     * the robot at addrs[i] responded within timeout milliseconds, or 0 if
+     * not. Returns the number of robots which responded.
+     */
+    static int checkStatusAll(const uint16_t addrs[], int num, uint8_t alive[],
+                              unsigned long timeout = 500);
+
+    /**
+     * Clear the list of addresses the robot has collected in response to
+     * queryAddresses().
+     */
+    int clearQueriedAddresses() { return command(LBCMD_CLEARQUERIEDADDRESSES); }
 
     /**
      * Drive a joint to a certain position using the on-board PID controller.
      * @param joint an integer; the joint to move
      * @param angle the angle to move the joint to in degrees
      */
-    int driveJointTo(int joint, float angle);
-    int driveJointToNB(int joint, float angle);
+    int driveJointTo(int joint, float angle) {
+      driveJointToNB(joint, angle);
+      return moveWait();
+    }
+    int driveJointToNB(int joint, float angle) {
+      return command(LBCMD_DRIVEJOINTTO, joint, angle);
+    }
 
     /**
      * Drive all of the joints to specified angles in degrees using the
      * on-board PID controller.
      */
-    int driveTo(float angle1, float angle2, float angle3);
-    int driveToNB(float angle1, float angle2, float angle3);
+    int driveTo(float angle1, float angle2, float angle3) {
+      driveToNB(angle1, angle2, angle3);
+      return moveWait();
+    }
+    int driveToNB(float angle1, float angle2, float angle3) {
+      return command(LBCMD_DRIVETO, angle1, angle2, angle3);
+    }
+
+    /**
+     * Ask every robot within range of this robot with the given 4-byte serial
+     * id to report its address. Matching robots answer with an address report
+     * which can be retrieved with readAddressReport().
+     */
+    int findRobot(const uint8_t serial[4]);
 
     /** 
      * Get the current accelerometer data values. Values of argument variables
-     * x, y, and z will be overwritten with values. 
+     * x, y, and z will be overwritten with values, in g.
      */
-    int getAccelerometerData(float &x, float &y, float &z);
+    int getAccelerometerData(float &x, float &y, float &z) {
+      return command(LBCMD_GETACCEL, &x, &y, &z);
+    }
 
     /** Get the current battery voltage.
      * @param volts the value of this variable will be overwritten with the
@@ -121,8 +334,56 @@ class Linkbot {
      */
     int getColorRGB(uint8_t &r, uint8_t &g, uint8_t &b);
 
+    /**
+     * Get the robot's form factor. form will be overwritten with one of the
+     * mobotFormFactor_t values. */
     int getFormFactor(int &form);
 
+    /** Get the robot's hardware revision number. */
+    int getHardwareRevision(int &revision);
+
+    /**
+     * Cached values.
+     * The form factor, hardware revision and firmware version are read from
+     * the robot once and then answered from a cache until reboot(). After
+     * enablePrefetch(), the battery voltage and LED color are also answered
+     * from the cache, and a LinkbotScheduler task refreshes them every
+     * interval milliseconds, and reads any value not yet cached, using only
+     * moments when no command is waiting on any link. Sketches using
+     * prefetch must run the scheduler, for instance with
+     * LinkbotScheduler::runOnce() in loop().
+     * getCacheAge() gives how old a prefetched value is in milliseconds, or
+     * (unsigned long)-1 if it has not been read yet or the robot does not
+     * prefetch.
+     */
+    int enablePrefetch(unsigned long interval = LINKBOT_PREFETCH_INTERVAL);
+    void disablePrefetch();
+    unsigned long getCacheAge(linkbotCacheItem_t item);
+
+    /** Called by the prefetch task. */
+    static unsigned long prefetchService();
+
+    /**
+     * Get the number of poses currently stored in the robot's pose table.
+     */
+    int getNumPoses(int &num) { return command(LBCMD_GETNUMPOSES, &num); }
+
+    /**
+     * Get the joint angles in degrees stored in one of the robot's poses.
+     * @param index the zero-based index of the pose
+     */
+    int getPoseData(int index, float &angle1, float &angle2, float &angle3) {
+      return command(LBCMD_GETPOSEDATA, index, &angle1, &angle2, &angle3);
+    }
+
+    /**
+     * Get the addresses the robot has collected so far in response to
+     * queryAddresses(). Each entry is 6 bytes: a 2-byte zigbee address, high
+     * byte first, followed by the 4-byte serial id. At most maxnum entries are
+     * copied into entries, and num is overwritten with the number copied.
+     */
+    int getQueriedAddresses(uint8_t entries[][6], int maxnum, int &num);
+
     /**
      * Get the current joint angle of a joint in degrees
      */
@@ -131,12 +392,72 @@ class Linkbot {
     /**
      * Get the current joint angles of all of the joints in degrees. Values of
      * parameters will be overwritten with joint angle values. */
-    int getJointAngles(float &angle1, float &angle2, float &angle3);
+    int getJointAngles(float &angle1, float &angle2, float &angle3) {
+      return command(LBCMD_GETJOINTANGLES, &angle1, &angle2, &angle3);
+    }
+
+    /**
+     * Get the joint angles along with the time the robot read them, in
+     * milliseconds on the robot's clock. LinkbotClock converts the time to
+     * millis() on the Arduino.
+     */
+    int getJointAnglesTimestamp(unsigned long &timestamp, float &angle1, float &angle2, float &angle3) {
+      float angle4;
+      return command(LBCMD_GETJOINTANGLESTIMESTAMP, &timestamp, &angle1, &angle2, &angle3, &angle4);
+    }
+
+    /**
+     * Ask for the joint angles without waiting for them, then collect them
+     * with pollJointAngles(). One request may be outstanding per instance;
+     * any other command on the instance abandons it.
+     * pollJointAngles() returns 1 once the angles are filled in, 0 while
+     * they are still on their way, or -1 if the request failed.
+     */
+    int requestJointAngles() { return commandNB(LBCMD_GETJOINTANGLES); }
+    int pollJointAngles(float &angle1, float &angle2, float &angle3) {
+      return commandPoll(LBCMD_GETJOINTANGLES, &angle1, &angle2, &angle3);
+    }
+
+    /**
+     * Get how far each joint is from the goal of its current motion, in
+     * degrees.
+     */
+    int getMotorErrors(float &error1, float &error2, float &error3) {
+      float error4;
+      return command(LBCMD_GETMOTORERRORS, &error1, &error2, &error3, &error4);
+    }
+
+    /** Get the version of the protocol the robot's firmware speaks. */
+    int getVersion(int &version);
 
     /**
      * Check to see if any of the joints are still moving. Returns 1 if moving,
      * 0 if not moving, or -1 on command failure.  */
-    int isMoving();
+    int isMoving() {
+      int moving;
+      return command(LBCMD_ISMOVING, &moving) ? -1 : moving;
+    }
+
+    /**
+     * Ask whether any joint is moving without waiting for the answer, then
+     * collect it with pollIsMoving(). As with requestJointAngles(), one
+     * request may be outstanding per instance.
+     * pollIsMoving() returns 1 once moving is filled in, 0 while the answer
+     * is still on its way, or -1 if the request failed.
+     */
+    int requestIsMoving() { return commandNB(LBCMD_ISMOVING); }
+    int pollIsMoving(int &moving) { return commandPoll(LBCMD_ISMOVING, &moving); }
+
+    /**
+     * Wait for the current motion to finish without blocking, for use in
+     * scheduler tasks; see LB_TASK_MOVE_WAIT(). Each call asks the robot
+     * whether it is moving every LINKBOT_MOVE_POLL milliseconds, or collects
+     * the answer. Returns 1 once the robot has stopped, 0 while it is
+     * moving, or -1 if it could not be asked. Another command on the
+     * instance meanwhile abandons the question, and the next call returns
+     * -1.
+     */
+    int pollMoveDone();
 
     /**
      * Move a joint from its current position by some angle in degrees at a
@@ -151,8 +472,39 @@ class Linkbot {
     /**
      * Move a joint to a certain angle in degrees at a constant speed.
      */
-    int moveJointTo(int joint, float angle);
-    int moveJointToNB(int joint, float angle);
+    int moveJointTo(int joint, float angle) {
+      moveJointToNB(joint, angle);
+      return moveWait();
+    }
+    int moveJointToNB(int joint, float angle) {
+      return command(LBCMD_MOVEJOINTTO, joint, angle);
+    }
+
+    /**
+     * Move a joint to a certain angle in degrees following a motion profile.
+     * The profile is planned on the Arduino and executed with the firmware's
+     * acceleration limited commands where possible. Accelerating gradually
+     * draws much less peak current from the battery than starting at full
+     * speed.
+     * @param profile the velocity profile to follow
+     * @param accel the acceleration limit in degrees/second^2. Ignored for
+     * PROFILE_CONSTANT.
+     * @param speed the top speed in degrees/second
+     * @param duration overwritten with the predicted duration of the motion in
+     * milliseconds
+     */
+    int moveJointProfile(int joint, float angle, linkbotMotionProfile_t profile,
+                         float accel, float speed);
+    int moveJointProfileNB(int joint, float angle, linkbotMotionProfile_t profile,
+                           float accel, float speed, unsigned long &duration);
+
+    /**
+     * Predict how long a motion following a motion profile takes, in
+     * milliseconds. Parameters have the same meaning as in
+     * moveJointProfile(); distance is the angle travelled in degrees.
+     */
+    static unsigned long motionDuration(linkbotMotionProfile_t profile,
+                                        float distance, float accel, float speed);
 
     /**
      * Move all of the joints by a relative number of degrees.
@@ -163,8 +515,35 @@ class Linkbot {
     /**
      * Move all of the joints to specified angles in degrees
      */
-    int moveTo(float angle1, float angle2, float angle3);
-    int moveToNB(float angle1, float angle2, float angle3);
+    int moveTo(float angle1, float angle2, float angle3) {
+      moveToNB(angle1, angle2, angle3);
+      return moveWait();
+    }
+    int moveToNB(float angle1, float angle2, float angle3) {
+      return command(LBCMD_MOVETO, angle1, angle2, angle3);
+    }
+
+    /**
+     * Move all of the joints to specified angles in degrees so that every
+     * joint arrives at the same time. Each joint's speed is scaled to its
+     * distance, so the joint travelling furthest moves at speed degrees/second
+     * and the others move proportionally slower.
+     * @param duration overwritten with the expected arrival time in
+     * milliseconds
+     */
+    int moveToSync(float angle1, float angle2, float angle3, float speed);
+    int moveToSyncNB(float angle1, float angle2, float angle3, float speed,
+                     unsigned long &duration);
+
+    /**
+     * Move all of the joints to a pose previously stored on the robot.
+     * @param index the zero-based index of the pose
+     */
+    int moveToPose(int index) {
+      moveToPoseNB(index);
+      return moveWait();
+    }
+    int moveToPoseNB(int index) { return command(LBCMD_MOVETOPOSE, index); }
 
     /**
      * Wait for a non-blocking joint motion to finish.
@@ -173,6 +552,34 @@ class Linkbot {
      */
     int moveWait();
 
+    /**
+     * Download the robot's pose table. At most maxposes poses are copied into
+     * the poses array, and num is overwritten with the number copied.
+     */
+    int downloadPoses(float poses[][3], int maxposes, int &num);
+
+    /**
+     * Begin playing the poses stored on the members of a group. This robot
+     * must be the group master. Once started, playback runs entirely on the
+     * robots and requires no further bus traffic.
+     * @param group_id the group id previously set with setGroup()
+     */
+    int playPoses(uint16_t group_id) { return command(LBCMD_PLAYPOSES, group_id); }
+
+    /**
+     * Broadcast a request for every robot within range of this robot to
+     * report its address and serial id. Reports arrive over the following
+     * second or so and can be retrieved with readAddressReport().
+     */
+    int queryAddresses() { return command(LBCMD_QUERYADDRESSES); }
+
+    /**
+     * Retrieve the next address report received from a remote robot. Returns
+     * 1 if a report was retrieved, or 0 if none are pending. Reports are
+     * buffered as they arrive, so this function never blocks.
+     */
+    static int readAddressReport(uint16_t &zigbee_addr, uint8_t serial[4]);
+
     /**
      * Reset multi-rotational joint angle counters on the robot.
      * This function is used to reset the multi-rotational angle counters on
@@ -181,11 +588,52 @@ class Linkbot {
      * joint angle reading instantly to 10 degrees.
      */
     int reset();
+    /** Reboot the robot. */
+    int reboot();
     /**
      * Reset joint rotation counters and move to zero.
      */
     int resetToZero();
 
+    /**
+     * Save the robot's current joint angles into its pose table.
+     * @param index the zero-based index of the pose to overwrite
+     */
+    int savePose(int index) { return command(LBCMD_SAVEPOSE, index); }
+
+    /**
+     * Make the robot a member of a group. Members of the same group follow
+     * group commands such as playPoses().
+     * @param group_id the 2-byte group id
+     * @param r, g, b the LED color members of the group display
+     */
+    int setGroup(uint16_t group_id, uint8_t r, uint8_t g, uint8_t b) {
+      return command(LBCMD_SETGROUP, group_id, r, g, b);
+    }
+
+    /** Make this robot the master of its group. */
+    int setGroupMaster() { return command(LBCMD_SETGROUPMASTER); }
+
+    /**
+     * Accelerate a joint at a constant rate.
+     * The joint stops accelerating once it reaches maxspeed or the joint's
+     * maximum speed.
+     * @param accel the acceleration in degrees/second^2
+     * @param maxspeed the speed in degrees/second to stop accelerating at
+     * @param timeout the time in milliseconds after which the motion ends
+     */
+    int setJointAcceleration(int joint, float accel, float maxspeed, unsigned long timeout) {
+      return command(LBCMD_SETACCEL, joint, accel, maxspeed, timeout);
+    }
+
+    /**
+     * Limit the acceleration of all of the joints at the beginning of each
+     * motion, in degrees/second^2.
+     */
+    int setGlobalAcceleration(float accel) {
+      return command(LBCMD_SETGLOBALACCEL, accel);
+    }
+
     /** Set a joint's speed in degrees/second */
     int setJointSpeed(int joint, float speed);
     int setJointSpeeds(float speed1, float speed2, float speed3);
@@ -196,22 +644,252 @@ class Linkbot {
      * Each value can range from 0 to 255. */
     int setLEDColor(uint8_t r, uint8_t g, uint8_t b);
 
+    /**
+     * Play a frequency on the buzzer, in Hz. A frequency of 0 stops the
+     * buzzer.
+     */
+    int setBuzzerFrequency(unsigned int frequency);
+
+    /**
+     * Shadow state.
+     * The robot's LED color, buzzer frequency, joint speeds and joint states
+     * are remembered once the robot acknowledges them, and setLEDColor(),
+     * setBuzzerFrequency(), setJointSpeed(), setJointState() and
+     * setJointStates() skip the command if it would not change anything.
+     * The remembered settings are forgotten when a command times out, on
+     * reset() and reboot(), and when stopAll() or stopGroup() is called;
+     * the joint states are also forgotten when any motion is started.
+     * setShadowing(0) sends every command, and invalidateShadow() makes the
+     * next setting of each kind go out regardless. shadowSuppressed() counts
+     * the commands skipped.
+     */
+    void setShadowing(int enable);
+    void invalidateShadow();
+    unsigned long shadowSuppressed();
+
     /** Set a motor's power. Power values can be from -255 to 255. */
-    int setMotorPower(int joint, int power);
-    int setMotorPowers(int power1, int power2, int power3);
+    int setMotorPower(int joint, int power) {
+      return command(LBCMD_SETMOTORPOWER, 1<<joint, power, power, power);
+    }
+    int setMotorPowers(int power1, int power2, int power3) {
+      return command(LBCMD_SETMOTORPOWER, 0x07, power1, power2, power3);
+    }
+    /** Set the motors' powers without waiting for the robot to answer. */
+    int setMotorPowersNB(int power1, int power2, int power3) {
+      return command(LBCMD_SETMOTORPOWERNB, 0x07, power1, power2, power3);
+    }
+
+    /** Cut the power to all motors, ahead of any queued commands. */
+    int powerOff() { return command(LBCMD_POWEROFF, 0x07); }
+
+    /**
+     * Move a joint smoothly to a certain angle in degrees.
+     * The joint accelerates at accel0 up to the speed vmax and decelerates at
+     * accelf before reaching the goal.
+     * @param accel0, accelf accelerations in degrees/second^2
+     * @param vmax the top speed in degrees/second
+     */
+    int smoothMoveJointTo(int joint, float angle, float accel0, float accelf, float vmax) {
+      smoothMoveJointToNB(joint, angle, accel0, accelf, vmax);
+      return moveWait();
+    }
+    int smoothMoveJointToNB(int joint, float angle, float accel0, float accelf, float vmax) {
+      return command(LBCMD_SMOOTHMOVE, joint, accel0, accelf, vmax, angle);
+    }
+
+    /**
+     * Turn the framed Link-Layer mode on or off for this robot. Framed
+     * commands and responses carry a CRC-8 and are byte-stuffed with
+     * MSG_ESCAPE, so a corrupted or truncated response is caught at once and
+     * the command sent again, up to LINKBOT_FRAME_RETRIES times. A command
+     * whose arguments hold so many MSG_ESCAPE bytes that it would not fit a
+     * TWI frame fails with -1. Turning it on sends the robot a framed
+     * command holding escaped bytes, which leaves the LED as it is; if the
+     * robot does not answer it in kind, framing stays off and -1 is
+     * returned.
+     */
+    int setFraming(int enable);
+
+    /**
+     * Stop all motors on the robot. The stop goes ahead of every queued
+     * command and is on the bus within LINKBOT_URGENT_TIMEOUT milliseconds,
+     * or the call fails. Commands waiting for a response from this robot are
+     * aborted and fail.
+     */
+    int stop() { return command(LBCMD_STOP); }
 
-    /** Stop all motors on the robot. */
-    int stop();
+    /**
+     * Stop every robot in range with a single broadcast, and the local robot.
+     * Every command waiting for a response is aborted.
+     */
+    static int stopAll();
+
+    /**
+     * Emergency stop every member of a group.
+     * @param group_id the group id previously set with setGroup()
+     */
+    static int stopGroup(uint16_t group_id);
+
+    /**
+     * Upload a sequence of poses to the robot's pose table. The robot's
+     * current table is downloaded and compared against the given poses first,
+     * and only the poses which differ by more than tolerance degrees on any
+     * joint are re-sent. Since the robot can only record its current
+     * position, each re-sent pose is driven to and then saved, so this
+     * function moves the robot. Returns the number of poses re-sent, or -1 on
+     * failure.
+     * @param poses an array of num poses, each holding 3 joint angles in degrees
+     */
+    int uploadPoses(const float poses[][3], int num, float tolerance = 0.5);
+
+    /**
+     * Compare the robot's pose table against the given poses. Returns 0 if
+     * every pose matches within tolerance degrees, the number of mismatching
+     * poses otherwise, or -1 on failure.
+     */
+    int verifyPoses(const float poses[][3], int num, float tolerance = 0.5);
+
+    /**
+     * Wait for several robots to finish their motions. Unlike calling
+     * moveWait() on each in turn, the robots are polled together, and each
+     * is only asked again about when its motors should reach their goals,
+     * so the wait ends soon after the last robot stops. More than
+     * LINKBOT_MAX_WAIT robots are waited on a batch at a time. Returns 0 on
+     * success, or -1 on failure.
+     */
+    static int waitAll(Linkbot *robots[], int num);
+
+    /**
+     * Wait for the first of several robots, at most LINKBOT_MAX_WAIT, to
+     * finish its motion. Returns the index of that robot in robots, or -1
+     * on failure.
+     */
+    static int waitAny(Linkbot *robots[], int num);
+
+    /**
+     * Get the largest number of frame buffers the library has used at once.
+     * If this reaches FRAMEPOOL_BLOCKS - 1, commands may fail for lack of
+     * a buffer, and FRAMEPOOL_BLOCKS should be raised; the last block is
+     * kept for urgent commands.
+     */
+    static int framePoolHighWater();
+
+    /**
+     * Get the longest time, in microseconds, an urgent command such as
+     * stop() has taken to be sent.
+     */
+    static unsigned long urgentLatencyMax();
+
+    /**
+     * Select how responses get back from the robots, on every link. See
+     * linkbotResponseMode_t and LinkbotBus::setResponseMode().
+     * @param readyPin in LINKBOT_RESPONSE_POLL mode, a pin the breakout board
+     *        pulls low while it holds a response, or -1 to poll on a timer
+     */
+    static void setResponseMode(linkbotResponseMode_t mode, int readyPin = -1);
+
+    /**
+     * Select how commands get to the robots. See linkbotCommandMode_t.
+     * Commands already queued in LINKBOT_COMMAND_PULL mode stay queued until
+     * they are pulled.
+     */
+    static void setCommandMode(linkbotCommandMode_t mode);
+
+    /**
+     * Set the TWI address the Arduino answers on, and the address of the
+     * breakout board of link 0; see LinkbotBus for more breakout boards.
+     * Needed when several Arduinos share one robot bus; they then take turns
+     * on the bus, backing off at random when two start at once. */
+    static void setBusAddresses(uint8_t slave_addr, uint8_t breakout_addr);
+
+    /**
+     * Get the link statistics gathered since the last resetLinkStats(),
+     * summed over every link. See LinkbotBus::getLinkStats() for one link.
+     */
+    static void getLinkStats(linkbotLinkStats_t &stats);
+    static void resetLinkStats();
+
+    /**
+     * Read registers on the local breakout board directly with
+     * MSG_REGACCESS. The register address is written and the data read back
+     * in one repeated-start transfer, bypassing the Link-Layer, so this is
+     * much cheaper than a command. readRegisters() reads num consecutive
+     * registers starting at reg. Returns 0 on success.
+     */
+    static int readRegister(uint8_t reg, uint8_t &value) {
+      return readRegisters(reg, &value, 1);
+    }
+    static int readRegisters(uint8_t reg, uint8_t *data, uint8_t num);
+
+    /**
+     * Write registers on the local breakout board directly with
+     * MSG_REGACCESS. writeRegisters() writes num consecutive registers
+     * starting at reg. Returns 0 on success.
+     */
+    static int writeRegister(uint8_t reg, uint8_t value) {
+      return writeRegisters(reg, &value, 1);
+    }
+    static int writeRegisters(uint8_t reg, const uint8_t *data, uint8_t num);
 
   private:
+    friend class LinkbotSetpointStream;
+    friend class LinkbotEstimator;
     uint16_t _zigbee_addr;
-    uint8_t _buf[64];
+    uint8_t _link;
+    uint8_t _framed;
+    uint8_t *_buf;
     uint8_t _bufsize;
+    uint8_t *_resp;
+    uint8_t _respLen;
+    uint8_t _expect;
+    void *_slot;
+    unsigned long _start;
+    unsigned long _startMicros;
+    uint8_t _shadowing;
+    uint8_t _shadowValid;
+    uint8_t _shadowEpoch;
+    uint8_t _shadowLED[3];
+    uint8_t _shadowStates[3];
+    uint16_t _shadowBuzzer;
+    float _shadowSpeeds[3];
+    unsigned long _suppressed;
+    uint8_t _txn;
+    uint8_t _cacheValid;
+    uint8_t _cacheFormFactor;
+    uint8_t _cacheHwRev;
+    uint8_t _cacheVersion;
+    float _goals[3];
+    uint8_t _goalValid;
+    unsigned long _motionAt;
+    uint8_t _movePolling;
+    unsigned long _movePollAt;
+    int beginTransaction();
+    int cacheFresh(linkbotCacheItem_t item);
+    void cacheStamp(linkbotCacheItem_t item);
+    void cancelTransaction();
+    int checkFrame();
+    int command(uint8_t id, ...);
+    int commandedSpeed(int joint, float &speed);
+    int commandNB(uint8_t id, ...);
+    int commandPoll(uint8_t id, ...);
+    void packCommand(uint8_t id, va_list *ap);
     void packBufReset();
     void packBufByte(uint8_t byte);
     void packBuf(void* data, int size);
     void packSimpleCmd(uint8_t cmd);
+    static int linkIdle();
+    int pollTransaction();
+    int poseMatches(int index, const float pose[3], float tolerance);
+    void releaseResponse();
+    int sendMessage(volatile uint8_t *error = NULL);
+    int sendUrgent(uint8_t answered);
+    int shadowMatches(uint8_t bits, const void *shadow, const void *value, uint8_t size);
+    void shadowUpdate(int rc, uint8_t bits, void *shadow, const void *value, uint8_t size);
+    uint8_t* takeFrame();
     int transactMessage();
+    int transactOnce();
+    void unpackResponse(uint8_t id, va_list *ap);
+    static int waitMany(Linkbot *robots[], int num, int any);
 };
 
 #endif
@@ -0,0 +1,157 @@
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "LinkbotBus.h"
+
+linkbotLink_t g_links[LINKBOT_MAX_LINKS] = {
+  { LINKBOT_BREAKOUT_ADDR, LINKBOT_RESPONSE_SLAVE, -1 },
+};
+uint8_t g_numLinks = 1;
+
+/* Remembered robot to link assignments */
+typedef struct busRobot_s {
+  uint16_t zigbee_addr;
+  uint8_t link;
+} busRobot_t;
+
+static busRobot_t g_busRobots[LINKBOT_BUS_ROBOTS];
+static uint8_t g_numBusRobots = 0;
+
+static busRobot_t* findRobot(uint16_t zigbee_addr)
+{
+  int i;
+  for(i = 0; i < g_numBusRobots; i++) {
+    if(g_busRobots[i].zigbee_addr == zigbee_addr) {
+      return &g_busRobots[i];
+    }
+  }
+  return NULL;
+}
+
+int LinkbotBus::addLink(uint8_t breakout_addr)
+{
+  linkbotLink_t *link;
+  if(g_numLinks >= LINKBOT_MAX_LINKS) {
+    return -1;
+  }
+  link = &g_links[g_numLinks];
+  memset(link, 0, sizeof(*link));
+  link->addr = breakout_addr;
+  link->responseMode = LINKBOT_RESPONSE_SLAVE;
+  link->readyPin = -1;
+  return g_numLinks++;
+}
+
+int LinkbotBus::assign(uint16_t zigbee_addr)
+{
+  busRobot_t *robot;
+  int best = 0;
+  int i;
+  if(zigbee_addr == 0 || zigbee_addr == LINKBOT_BROADCAST_ADDR) {
+    return 0;
+  }
+  robot = findRobot(zigbee_addr);
+  if(robot != NULL) {
+    return robot->link;
+  }
+  for(i = 1; i < g_numLinks; i++) {
+    if(g_links[i].robots < g_links[best].robots) {
+      best = i;
+    }
+  }
+  /* With the table full, spread the rest by address */
+  if(g_numBusRobots >= LINKBOT_BUS_ROBOTS) {
+    return zigbee_addr % g_numLinks;
+  }
+  robot = &g_busRobots[g_numBusRobots++];
+  robot->zigbee_addr = zigbee_addr;
+  robot->link = best;
+  g_links[best].robots++;
+  return best;
+}
+
+int LinkbotBus::count()
+{
+  return g_numLinks;
+}
+
+int LinkbotBus::getLinkStats(int link, linkbotLinkStats_t &stats)
+{
+  uint8_t sreg;
+  if(link < 0 || link >= g_numLinks) {
+    return -1;
+  }
+  sreg = SREG;
+  cli();
+  stats = g_links[link].stats;
+  SREG = sreg;
+  return 0;
+}
+
+int LinkbotBus::linkOf(uint16_t zigbee_addr)
+{
+  busRobot_t *robot = findRobot(zigbee_addr);
+  return (robot != NULL) ? robot->link : 0;
+}
+
+int LinkbotBus::isKnown(uint16_t zigbee_addr)
+{
+  return findRobot(zigbee_addr) != NULL;
+}
+
+int LinkbotBus::resetLinkStats(int link)
+{
+  uint8_t sreg;
+  if(link < 0 || link >= g_numLinks) {
+    return -1;
+  }
+  sreg = SREG;
+  cli();
+  memset(&g_links[link].stats, 0, sizeof(g_links[link].stats));
+  SREG = sreg;
+  return 0;
+}
+
+int LinkbotBus::setAddress(int link, uint8_t breakout_addr)
+{
+  if(link < 0 || link >= g_numLinks) {
+    return -1;
+  }
+  g_links[link].addr = breakout_addr;
+  return 0;
+}
+
+int LinkbotBus::setLink(uint16_t zigbee_addr, int link)
+{
+  busRobot_t *robot;
+  if(link < 0 || link >= g_numLinks) {
+    return -1;
+  }
+  robot = findRobot(zigbee_addr);
+  if(robot == NULL) {
+    if(g_numBusRobots >= LINKBOT_BUS_ROBOTS) {
+      return -1;
+    }
+    robot = &g_busRobots[g_numBusRobots++];
+    robot->zigbee_addr = zigbee_addr;
+  } else {
+    g_links[robot->link].robots--;
+  }
+  robot->link = link;
+  g_links[link].robots++;
+  return 0;
+}
+
+int LinkbotBus::setResponseMode(int link, linkbotResponseMode_t mode, int readyPin)
+{
+  if(link < 0 || link >= g_numLinks) {
+    return -1;
+  }
+  g_links[link].responseMode = mode;
+  g_links[link].readyPin = readyPin;
+  if(readyPin >= 0) {
+    pinMode(readyPin, INPUT_PULLUP);
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef _LINKBOT_BUS_H_
+#define _LINKBOT_BUS_H_
+
+#include "Linkbot.h"
+
+/* The most breakout boards one Arduino drives */
+#ifndef LINKBOT_MAX_LINKS
+#define LINKBOT_MAX_LINKS 4
+#endif
+
+/* The most robots whose link assignment is remembered */
+#ifndef LINKBOT_BUS_ROBOTS
+#define LINKBOT_BUS_ROBOTS 16
+#endif
+
+/* One breakout board and its radio. Used by the Linkbot class. */
+typedef struct linkbotLink_s
+{
+  uint8_t addr;                 /* TWI address of the breakout board */
+  uint8_t responseMode;         /* a linkbotResponseMode_t */
+  int8_t readyPin;
+  volatile uint8_t pollInFlight;
+  unsigned long lastPoll;
+  uint8_t robots;               /* robots assigned to the link */
+  linkbotLinkStats_t stats;
+} linkbotLink_t;
+
+extern linkbotLink_t g_links[LINKBOT_MAX_LINKS];
+extern uint8_t g_numLinks;
+
+/**
+ * The LinkbotBus Class.
+ * Manages the breakout boards one Arduino reaches its robots through. Each
+ * breakout board is a link with its own TWI address and radio. Link 0 is the
+ * breakout board at LINKBOT_BREAKOUT_ADDR and always exists; more are added
+ * with addLink()::
+
+      void setup() {
+        LinkbotBus::addLink(0x03);
+        LinkbotBus::addLink(0x04);
+        Linkbot a(0x1234), b(0x2345), c(0x3456);
+        ...
+      }
+
+  Each remote robot is assigned to the link with the fewest robots the
+  first time it is addressed, and keeps that link from then on, so the
+  commands for different robots go out over different radios. The local
+  robot is always on link 0. Broadcasts such as Linkbot::stopAll() go out on
+  every link.
+
+  Responses in LINKBOT_RESPONSE_SLAVE mode all arrive on the Arduino's one
+  slave address, and LINKBOT_COMMAND_PULL mode only serves link 0.
+ */
+class LinkbotBus {
+  public:
+    /**
+     * Add a breakout board at a TWI address. Returns the new link's id, or
+     * -1 if LINKBOT_MAX_LINKS links exist already.
+     */
+    static int addLink(uint8_t breakout_addr);
+
+    /** Get the number of links. */
+    static int count();
+
+    /** Change the TWI address of a link's breakout board. */
+    static int setAddress(int link, uint8_t breakout_addr);
+
+    /**
+     * Get the link a robot is assigned to, assigning it to the least loaded
+     * link if it has none yet.
+     */
+    static int assign(uint16_t zigbee_addr);
+
+    /**
+     * Get the link a robot is assigned to without assigning it. Robots
+     * without a link are reported on link 0.
+     */
+    static int linkOf(uint16_t zigbee_addr);
+
+    /** Check whether a robot is in the table of remembered assignments. */
+    static int isKnown(uint16_t zigbee_addr);
+
+    /**
+     * Assign a robot to a particular link, for example the one whose radio
+     * is closest to it. Takes effect for Linkbot instances created later.
+     */
+    static int setLink(uint16_t zigbee_addr, int link);
+
+    /** Select how responses get back over one link. */
+    static int setResponseMode(int link, linkbotResponseMode_t mode, int readyPin = -1);
+
+    /** Get and clear one link's statistics. */
+    static int getLinkStats(int link, linkbotLinkStats_t &stats);
+    static int resetLinkStats(int link);
+};
+
+#endif
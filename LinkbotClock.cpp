@@ -0,0 +1,124 @@
+
+#include <Arduino.h>
+
+#include "LinkbotClock.h"
+
+#define RTT_NONE ((unsigned long)-1)
+
+LinkbotClock::LinkbotClock(Linkbot &robot)
+{
+  _robot = &robot;
+  _synced = 0;
+  _count = 0;
+  _offset = 0;
+  _anchor = 0;
+  _anchorRtt = RTT_NONE;
+  _drift = 0;
+  _baseOffset = 0;
+  _base = 0;
+  _bestRtt = RTT_NONE;
+}
+
+int LinkbotClock::sync(int samples)
+{
+  unsigned long timestamp;
+  unsigned long sent;
+  float angles[4];
+  int good = 0;
+  int i;
+  /* Start a fresh window so the estimate comes from these reads alone */
+  _count = 0;
+  _bestRtt = RTT_NONE;
+  for(i = 0; i < samples; i++) {
+    sent = micros();
+    if(_robot->getJointAnglesTimestamp(timestamp, angles[0], angles[1], angles[2])) {
+      continue;
+    }
+    addSample(timestamp, sent, micros());
+    good++;
+  }
+  if(good == 0) {
+    return -1;
+  }
+  if(_bestRtt != RTT_NONE) {
+    commit();
+  }
+  return 0;
+}
+
+int LinkbotClock::getJointAngles(unsigned long &time, float &angle1, float &angle2, float &angle3)
+{
+  unsigned long timestamp;
+  unsigned long sent = micros();
+  if(_robot->getJointAnglesTimestamp(timestamp, angle1, angle2, angle3)) {
+    return -1;
+  }
+  addSample(timestamp, sent, micros());
+  time = toLocal(timestamp);
+  return 0;
+}
+
+void LinkbotClock::addSample(unsigned long robotTime, unsigned long sentMicros, unsigned long receivedMicros)
+{
+  unsigned long rtt = receivedMicros - sentMicros;
+  /* millis() halfway between sending and receiving */
+  unsigned long midpoint = millis() - (micros() - sentMicros - rtt / 2) / 1000;
+  if(rtt < _bestRtt) {
+    _bestRtt = rtt;
+    _bestOffset = (long)(robotTime - midpoint);
+    _bestAt = midpoint;
+  }
+  /* Use the first read straight away, until a window has been filled */
+  if(!_synced) {
+    _offset = _baseOffset = _bestOffset;
+    _anchor = _base = _bestAt;
+    _anchorRtt = _bestRtt;
+    _synced = 1;
+  }
+  if(++_count >= LINKBOT_CLOCK_WINDOW) {
+    commit();
+  }
+}
+
+/* Take the best read of the window as the new estimate */
+void LinkbotClock::commit()
+{
+  long span;
+  /* The first full window replaces the rough first read as the base */
+  if(_anchorRtt != RTT_NONE && _anchor == _base && _bestRtt <= _anchorRtt) {
+    _baseOffset = _bestOffset;
+    _base = _bestAt;
+  }
+  _offset = _bestOffset;
+  _anchor = _bestAt;
+  _anchorRtt = _bestRtt;
+  span = (long)(_anchor - _base);
+  if(span >= LINKBOT_CLOCK_DRIFT_SPAN) {
+    _drift = (float)(_offset - _baseOffset) / span;
+  }
+  _count = 0;
+  _bestRtt = RTT_NONE;
+}
+
+int LinkbotClock::isSynced()
+{
+  return _synced;
+}
+
+unsigned long LinkbotClock::toLocal(unsigned long robotTime)
+{
+  unsigned long local = robotTime - _offset;
+  return local - (long)(_drift * (long)(local - _anchor));
+}
+
+unsigned long LinkbotClock::toRobot(unsigned long localTime)
+{
+  return localTime + _offset + (long)(_drift * (long)(localTime - _anchor));
+}
+
+void LinkbotClock::getEstimate(long &offset, float &drift, unsigned long &uncertainty)
+{
+  offset = _offset;
+  drift = _drift;
+  uncertainty = _anchorRtt / 2;
+}
@@ -0,0 +1,100 @@
+#ifndef _LINKBOT_CLOCK_H_
+#define _LINKBOT_CLOCK_H_
+
+#include "Linkbot.h"
+
+/* How many timestamped reads make up one estimate of a robot's clock; the
+ * read with the shortest round trip is used */
+#ifndef LINKBOT_CLOCK_WINDOW
+#define LINKBOT_CLOCK_WINDOW 8
+#endif
+
+/* How far apart, in milliseconds, two estimates must be before the drift
+ * between them is trusted */
+#ifndef LINKBOT_CLOCK_DRIFT_SPAN
+#define LINKBOT_CLOCK_DRIFT_SPAN 10000
+#endif
+
+/**
+ * The LinkbotClock Class.
+ * Maps a robot's millisecond clock onto millis() on the Arduino, for
+ * example::
+
+      LinkbotClock clock(robot);
+
+      void setup() {
+        clock.sync();
+      }
+
+      void loop() {
+        unsigned long sampled;
+        float a1, a2, a3;
+        clock.getJointAngles(sampled, a1, a2, a3);
+        // a1..a3 are (millis() - sampled) milliseconds old
+      }
+
+  Each timestamped read gives the robot's time somewhere between sending
+  the request and getting the response; taking it as the midpoint is off
+  by at most half the round trip. Of every LINKBOT_CLOCK_WINDOW reads only
+  the one with the shortest round trip is kept, as the others were held up
+  on the way. The clocks' offset comes from the latest such read, and
+  their drift from the span between the first and the latest.
+ */
+class LinkbotClock {
+  public:
+    LinkbotClock(Linkbot &robot);
+
+    /**
+     * Estimate the robot's clock afresh from samples timestamped reads.
+     * Returns 0 on success, or -1 if none of the reads succeeded.
+     */
+    int sync(int samples = LINKBOT_CLOCK_WINDOW);
+
+    /**
+     * Get the joint angles and the millis() at which the robot read them.
+     * The read also refines the clock estimate, so until sync() has been
+     * called the time is only as good as one read. Returns -1 on failure.
+     */
+    int getJointAngles(unsigned long &time, float &angle1, float &angle2, float &angle3);
+
+    /**
+     * Refine the estimate with a robot timestamp from another command.
+     * @param robotTime the robot's timestamp
+     * @param sentMicros micros() just before the command was sent
+     * @param receivedMicros micros() just after the response arrived
+     */
+    void addSample(unsigned long robotTime, unsigned long sentMicros, unsigned long receivedMicros);
+
+    /** Check whether the clock has been estimated. */
+    int isSynced();
+
+    /** Convert a time on the robot's clock to millis() on the Arduino. */
+    unsigned long toLocal(unsigned long robotTime);
+
+    /** Convert millis() on the Arduino to a time on the robot's clock. */
+    unsigned long toRobot(unsigned long localTime);
+
+    /**
+     * Get the estimate: the robot's clock minus millis() in milliseconds,
+     * how many milliseconds the robot's clock gains per millisecond, and how
+     * far off the offset may be, in microseconds.
+     */
+    void getEstimate(long &offset, float &drift, unsigned long &uncertainty);
+
+  private:
+    void commit();
+    Linkbot *_robot;
+    uint8_t _synced;
+    uint8_t _count;
+    long _offset;
+    unsigned long _anchor;
+    unsigned long _anchorRtt;
+    float _drift;
+    long _baseOffset;
+    unsigned long _base;
+    long _bestOffset;
+    unsigned long _bestAt;
+    unsigned long _bestRtt;
+};
+
+#endif
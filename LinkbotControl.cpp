@@ -0,0 +1,145 @@
+
+#include <Arduino.h>
+
+#include "LinkbotControl.h"
+#include "LinkbotScheduler.h"
+
+LinkbotControlLoop::LinkbotControlLoop(Linkbot &robot, linkbotControlFunc_t func, void *context)
+{
+  _robot = &robot;
+  _func = func;
+  _context = context;
+  _period = 0;
+  _deadline = 0;
+  _running = 0;
+  _reading = 0;
+  _fresh = 0;
+  memset(_angles, 0, sizeof(_angles));
+  memset(_powers, 0, sizeof(_powers));
+  resetStats();
+}
+
+int LinkbotControlLoop::begin(unsigned long period_us, unsigned long deadline_us)
+{
+  if(period_us == 0) {
+    return -1;
+  }
+  _period = period_us;
+  _deadline = (deadline_us != 0) ? deadline_us : period_us / 2;
+  _fresh = 0;
+  _reading = (_robot->requestJointAngles() == 0);
+  _next = micros() + _period;
+  _running = 1;
+  resetStats();
+  return 0;
+}
+
+void LinkbotControlLoop::end()
+{
+  _running = 0;
+}
+
+/* Pick up the outstanding angle read if it has arrived. Returns 1 if fresh
+ * angles are waiting, 0 if the read is still on its way, or -1 if there is
+ * no read to wait for. */
+int LinkbotControlLoop::collect()
+{
+  int rc;
+  if(_fresh) {
+    return 1;
+  }
+  if(!_reading) {
+    return -1;
+  }
+  rc = _robot->pollJointAngles(_angles[0], _angles[1], _angles[2]);
+  if(rc == 0) {
+    return 0;
+  }
+  _reading = 0;
+  if(rc < 0) {
+    _stats.readErrors++;
+    return -1;
+  }
+  _sampled = micros();
+  _fresh = 1;
+  return 1;
+}
+
+int LinkbotControlLoop::update()
+{
+  unsigned long now;
+  unsigned long elapsed;
+  int rc;
+  if(!_running) {
+    return -1;
+  }
+  /* Not due yet; just pick up the read if it is in */
+  if((long)(micros() - _next) < 0) {
+    collect();
+    return 0;
+  }
+  /* Wait for the angles until the deadline. Other tasks don't run here, so
+   * they can't delay the tick. */
+  while((rc = collect()) == 0) {
+    if((long)(micros() - _next) >= (long)_deadline) {
+      break;
+    }
+  }
+  if(rc > 0) {
+    _func(_angles, _powers, _context);
+    _fresh = 0;
+    _robot->setMotorPowersNB(_powers[0], _powers[1], _powers[2]);
+    now = micros();
+    elapsed = now - _sampled;
+    _stats.ticks++;
+    _stats.latencyTotal += elapsed;
+    if(elapsed > _stats.latencyMax) {
+      _stats.latencyMax = elapsed;
+    }
+    elapsed = now - _next;
+    _stats.jitterTotal += elapsed;
+    if(elapsed > _stats.jitterMax) {
+      _stats.jitterMax = elapsed;
+    }
+  } else if(rc == 0) {
+    /* Keep waiting on the late read; the next tick may still use it */
+    _stats.overruns++;
+  }
+  /* Ask for the next tick's angles while the powers are on their way */
+  if(!_reading && !_fresh) {
+    _reading = (_robot->requestJointAngles() == 0);
+  }
+  _next += _period;
+  /* A whole period behind; drop the missed ticks rather than run them
+   * back to back */
+  now = micros();
+  if((long)(now - _next) >= 0) {
+    _next = now + _period;
+  }
+  return 1;
+}
+
+int LinkbotControlLoop::run(unsigned long duration_ms)
+{
+  unsigned long start = millis();
+  if(!_running) {
+    return -1;
+  }
+  while((millis() - start) < duration_ms) {
+    update();
+    if((long)(micros() - _next) < 0) {
+      LinkbotScheduler::yield();
+    }
+  }
+  return 0;
+}
+
+void LinkbotControlLoop::getStats(linkbotControlStats_t &stats)
+{
+  stats = _stats;
+}
+
+void LinkbotControlLoop::resetStats()
+{
+  memset(&_stats, 0, sizeof(_stats));
+}
@@ -0,0 +1,107 @@
+#ifndef _LINKBOT_CONTROL_H_
+#define _LINKBOT_CONTROL_H_
+
+#include "Linkbot.h"
+
+/**
+ * A control law. Called once per tick with the latest joint angles in
+ * degrees; fills in the motor powers to apply, from -255 to 255. powers
+ * holds the previous tick's values on entry. */
+typedef void (*linkbotControlFunc_t)(const float angles[3], int powers[3], void *context);
+
+/**
+ * Timing statistics of a control loop. Times are in microseconds. Jitter is
+ * how late a tick's actuation went out after its scheduled time; latency is
+ * the time from the joint angles arriving to the powers computed from them
+ * being sent. */
+typedef struct linkbotControlStats_s
+{
+  unsigned long ticks;        /* ticks which ran the control law */
+  unsigned long overruns;     /* ticks whose angles missed the deadline */
+  unsigned long readErrors;   /* angle reads which failed outright */
+  unsigned long jitterMax;
+  unsigned long jitterTotal;
+  unsigned long latencyMax;
+  unsigned long latencyTotal;
+} linkbotControlStats_t;
+
+/**
+ * The LinkbotControlLoop Class.
+ * Runs a control law against one robot at a fixed rate, for example::
+
+      void balance(const float angles[3], int powers[3], void *context)
+      {
+        powers[0] = (int)(-4.0 * angles[0]);
+        powers[2] = -powers[0];
+      }
+
+      LinkbotControlLoop balancer(robot, balance, NULL);
+
+      void setup() {
+        balancer.begin(10000);   // 100 Hz
+      }
+
+      void loop() {
+        balancer.update();
+      }
+
+  Each tick sends the new motor powers without waiting for the robot to
+  answer and asks for the next tick's joint angles straight after, so the
+  read is on its way while the loop sleeps. If the angles have not arrived
+  by the tick's deadline the tick is counted as an overrun, the control law
+  is skipped and the motors keep their last powers.
+
+  While the loop runs, the robot should not be sent other commands: a
+  blocking command abandons the loop's outstanding read.
+ */
+class LinkbotControlLoop {
+  public:
+    LinkbotControlLoop(Linkbot &robot, linkbotControlFunc_t func, void *context);
+
+    /**
+     * Start the loop. The first tick is one period from now.
+     * @param period_us the tick period in microseconds
+     * @param deadline_us how long past its scheduled time a tick may wait
+     * for the joint angles. Defaults to half the period.
+     */
+    int begin(unsigned long period_us, unsigned long deadline_us = 0);
+
+    /** Stop the loop. The motors keep their last powers. */
+    void end();
+
+    /**
+     * Run the current tick if it is due. Call as often as possible. Returns
+     * 1 if a tick ran, 0 if none was due, or -1 if the loop is not running.
+     */
+    int update();
+
+    /**
+     * Run the loop for duration_ms milliseconds, letting other tasks run
+     * between ticks.
+     */
+    int run(unsigned long duration_ms);
+
+    /** Get the timing statistics since begin() or resetStats(). */
+    void getStats(linkbotControlStats_t &stats);
+
+    /** Clear the timing statistics. */
+    void resetStats();
+
+  private:
+    int collect();
+    Linkbot *_robot;
+    linkbotControlFunc_t _func;
+    void *_context;
+    unsigned long _period;
+    unsigned long _deadline;
+    unsigned long _next;
+    unsigned long _sampled;
+    float _angles[3];
+    int _powers[3];
+    uint8_t _running;
+    uint8_t _reading;
+    uint8_t _fresh;
+    linkbotControlStats_t _stats;
+};
+
+#endif
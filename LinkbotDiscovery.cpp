@@ -0,0 +1,163 @@
+
+#include <Arduino.h>
+
+#include "LinkbotDiscovery.h"
+
+/* log2(LINKBOT_DISCOVERY_CAPACITY), for taking the table index from the top
+ * bits of the hash */
+#define CAPACITY_BITS \
+  ((LINKBOT_DISCOVERY_CAPACITY >= 128) ? 7 : \
+   (LINKBOT_DISCOVERY_CAPACITY >= 64) ? 6 : \
+   (LINKBOT_DISCOVERY_CAPACITY >= 32) ? 5 : \
+   (LINKBOT_DISCOVERY_CAPACITY >= 16) ? 4 : \
+   (LINKBOT_DISCOVERY_CAPACITY >= 8) ? 3 : \
+   (LINKBOT_DISCOVERY_CAPACITY >= 4) ? 2 : 1)
+
+LinkbotDiscovery::LinkbotDiscovery(Linkbot &gateway)
+{
+  _gateway = &gateway;
+  clear();
+}
+
+int LinkbotDiscovery::begin()
+{
+  if(_gateway->clearQueriedAddresses()) {
+    return -1;
+  }
+  return _gateway->queryAddresses();
+}
+
+int LinkbotDiscovery::poll()
+{
+  uint16_t addr;
+  uint8_t serial[4];
+  int added = 0;
+  int before;
+  while(Linkbot::readAddressReport(addr, serial)) {
+    before = _count;
+    insert(serialKey(serial), addr);
+    added += _count - before;
+  }
+  return added;
+}
+
+int LinkbotDiscovery::scan(unsigned long timeout)
+{
+  unsigned long startMillis;
+  uint8_t entries[4][6];
+  int num;
+  int i;
+  if(begin()) {
+    return -1;
+  }
+  startMillis = millis();
+  while((millis() - startMillis) < timeout) {
+    poll();
+  }
+  poll();
+  /* The gateway's list holds as many entries as fit in one response */
+  if(_gateway->getQueriedAddresses(entries, 4, num) == 0) {
+    for(i = 0; i < num; i++) {
+      insert(serialKey(&entries[i][2]), ((uint16_t)entries[i][0] << 8) | entries[i][1]);
+    }
+  }
+  return _count;
+}
+
+int LinkbotDiscovery::find(const char serial[4], uint16_t &zigbee_addr)
+{
+  return find(serialKey((const uint8_t*)serial), zigbee_addr);
+}
+
+int LinkbotDiscovery::find(uint32_t serial, uint16_t &zigbee_addr)
+{
+  int i = slot(serial);
+  if(i < 0 || _table[i].serial != serial) {
+    return -1;
+  }
+  zigbee_addr = _table[i].zigbee_addr;
+  return 0;
+}
+
+int LinkbotDiscovery::locate(const char serial[4], uint16_t &zigbee_addr, unsigned long timeout)
+{
+  unsigned long startMillis;
+  uint32_t key = serialKey((const uint8_t*)serial);
+  poll();
+  if(find(key, zigbee_addr) == 0) {
+    return 0;
+  }
+  if(_gateway->findRobot((const uint8_t*)serial)) {
+    return -1;
+  }
+  startMillis = millis();
+  while((millis() - startMillis) < timeout) {
+    poll();
+    if(find(key, zigbee_addr) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int LinkbotDiscovery::insert(uint32_t serial, uint16_t zigbee_addr)
+{
+  int i = slot(serial);
+  if(i < 0 || serial == 0) {
+    return -1;
+  }
+  if(_table[i].serial != serial) {
+    _table[i].serial = serial;
+    _count++;
+  }
+  /* A robot which reports again may have been given a new address */
+  _table[i].zigbee_addr = zigbee_addr;
+  return 0;
+}
+
+void LinkbotDiscovery::clear()
+{
+  memset(_table, 0, sizeof(_table));
+  _count = 0;
+}
+
+int LinkbotDiscovery::count()
+{
+  return _count;
+}
+
+int LinkbotDiscovery::get(int index, uint32_t &serial, uint16_t &zigbee_addr)
+{
+  if(index < 0 || index >= LINKBOT_DISCOVERY_CAPACITY || _table[index].serial == 0) {
+    return -1;
+  }
+  serial = _table[index].serial;
+  zigbee_addr = _table[index].zigbee_addr;
+  return 0;
+}
+
+uint32_t LinkbotDiscovery::serialKey(const uint8_t serial[4])
+{
+  return ((uint32_t)serial[0] << 24) |
+         ((uint32_t)serial[1] << 16) |
+         ((uint32_t)serial[2] << 8) |
+         serial[3];
+}
+
+/* Find the slot holding serial, or the empty slot it would be inserted into.
+ * Returns -1 if serial is absent and the table is full. */
+int LinkbotDiscovery::slot(uint32_t serial)
+{
+  uint8_t i;
+  uint8_t n;
+  /* Fibonacci hashing spreads the ASCII serial ids across the table; the
+   * well-mixed bits are the top ones */
+  i = (uint8_t)((serial * 2654435769UL) >> (32 - CAPACITY_BITS));
+  for(n = 0; n < LINKBOT_DISCOVERY_CAPACITY; n++) {
+    if(_table[i].serial == serial || _table[i].serial == 0) {
+      return i;
+    }
+    i = (i + 1) & (LINKBOT_DISCOVERY_CAPACITY-1);
+  }
+  return -1;
+}
@@ -0,0 +1,106 @@
+#ifndef _LINKBOT_DISCOVERY_H_
+#define _LINKBOT_DISCOVERY_H_
+
+#include "Linkbot.h"
+
+/* The capacity of the address table. Must be a power of two no larger than
+ * 128, and should be comfortably larger than the number of robots
+ * expected. */
+#ifndef LINKBOT_DISCOVERY_CAPACITY
+#define LINKBOT_DISCOVERY_CAPACITY 32
+#endif
+
+/**
+ * A discovered robot. A serial id of 0 marks an empty table slot. */
+typedef struct linkbotAddress_s
+{
+  uint32_t serial;
+  uint16_t zigbee_addr;
+} linkbotAddress_t;
+
+/**
+ * The LinkbotDiscovery Class.
+ * Finds the remote Linkbots within range of a gateway Linkbot, usually the
+ * locally connected one, and keeps a table mapping each robot's 4-byte serial
+ * id to its zigbee address.
+
+  A scan broadcasts a single address query and then collects the address
+  reports as they arrive, so the whole room answers in parallel::
+
+      Linkbot local;
+      LinkbotDiscovery discovery(local);
+      discovery.scan(2000);
+      uint16_t addr;
+      if(discovery.find("ABCD", addr) == 0) {
+        Linkbot remote(addr);
+        ...
+      }
+
+  Lookups by serial id take constant time and never touch the bus.
+ */
+class LinkbotDiscovery {
+  public:
+    LinkbotDiscovery(Linkbot &gateway);
+
+    /**
+     * Start a discovery. The robots collected by an earlier query are
+     * forgotten on the gateway and an address query is broadcast. The local
+     * table is kept; call clear() to empty it.
+     */
+    int begin();
+
+    /**
+     * Add the address reports which arrived since the last call to the
+     * table. Returns the number of new robots. Never blocks.
+     */
+    int poll();
+
+    /**
+     * Run a complete discovery: begin(), then poll() for timeout
+     * milliseconds, then merge the gateway's own list of queried addresses
+     * in case any report was dropped. Returns the number of robots in the
+     * table, or -1 on failure.
+     */
+    int scan(unsigned long timeout);
+
+    /**
+     * Look up the zigbee address of a robot by serial id. Returns 0 if the
+     * robot is in the table, or -1 if not.
+     */
+    int find(const char serial[4], uint16_t &zigbee_addr);
+    int find(uint32_t serial, uint16_t &zigbee_addr);
+
+    /**
+     * Look up a robot by serial id, and if it is not in the table yet, ask
+     * that robot alone to report its address. Waits at most timeout
+     * milliseconds for the report. Returns 0 on success.
+     */
+    int locate(const char serial[4], uint16_t &zigbee_addr, unsigned long timeout);
+
+    /** Add a robot to the table by hand. Returns 0 on success or -1 if the
+     * table is full. */
+    int insert(uint32_t serial, uint16_t zigbee_addr);
+
+    /** Forget all discovered robots. */
+    void clear();
+
+    /** Get the number of robots in the table. */
+    int count();
+
+    /**
+     * Get a robot from the table. Valid indices are 0 to
+     * LINKBOT_DISCOVERY_CAPACITY-1; empty slots return -1.
+     */
+    int get(int index, uint32_t &serial, uint16_t &zigbee_addr);
+
+    /** Pack a 4-byte serial id, such as "ABCD", into a table key. */
+    static uint32_t serialKey(const uint8_t serial[4]);
+
+  private:
+    int slot(uint32_t serial);
+    Linkbot *_gateway;
+    linkbotAddress_t _table[LINKBOT_DISCOVERY_CAPACITY];
+    uint8_t _count;
+};
+
+#endif
@@ -0,0 +1,128 @@
+
+#include <Arduino.h>
+#include <math.h>
+
+#include "LinkbotEstimator.h"
+
+LinkbotEstimator::LinkbotEstimator(Linkbot &robot, float maxSpeed)
+{
+  _robot = &robot;
+  _maxSpeed = maxSpeed;
+  _measured = 0;
+  _still = 0;
+  _predicted = 0;
+  _measurements = 0;
+}
+
+int LinkbotEstimator::measure()
+{
+  float angles[3];
+  unsigned long start = millis();
+  unsigned long at;
+  uint8_t still;
+  int i;
+  if(_robot->getJointAngles(angles[0], angles[1], angles[2])) {
+    return -1;
+  }
+  /* The robot read the angles somewhere in the round trip */
+  at = start + (millis() - start) / 2;
+  _measurements++;
+  /* Two matching measurements with no motion commanded between them mean
+   * the joints are still */
+  still = 0;
+  if(_measured && (long)(_robot->_motionAt - _at) < 0) {
+    still = 0x07;
+    for(i = 0; i < 3; i++) {
+      if(fabs(angles[i] - _angles[i]) > LINKBOT_ESTIMATE_ERROR) {
+        still &= ~(1 << i);
+      }
+    }
+  }
+  memcpy(_angles, angles, sizeof(angles));
+  _prevAt = _at;
+  _at = at;
+  _still = still;
+  _measured = 1;
+  return 0;
+}
+
+/* Predict one joint's angle at now, and how far off it may be */
+float LinkbotEstimator::predict(int joint, unsigned long now, float &bound)
+{
+  float angle = _angles[joint];
+  float distance;
+  float travel;
+  float slack;
+  float speed;
+  unsigned long start;
+  long elapsed;
+  if(_robot->_goalValid & (1 << joint)) {
+    /* Turning towards a goal, from the later of the measurement and the
+     * command */
+    start = ((long)(_robot->_motionAt - _at) > 0) ? _robot->_motionAt : _at;
+    elapsed = (long)(now - start);
+    if(elapsed < 0) {
+      elapsed = 0;
+    }
+    distance = _robot->_goals[joint] - angle;
+    if(_robot->commandedSpeed(joint + 1, speed) == 0 && speed > 0) {
+      travel = speed * elapsed / 1000.0;
+      /* The motion may have started late, and may run up to 10% slow */
+      slack = speed * LINKBOT_ESTIMATE_LAG / 1000.0 + 0.1 * travel;
+      if(travel >= fabs(distance)) {
+        bound = LINKBOT_ESTIMATE_ERROR +
+          fmin(fabs(distance), fmax(0, slack - (travel - fabs(distance))));
+        return _robot->_goals[joint];
+      }
+      bound = LINKBOT_ESTIMATE_ERROR + fmin(travel, slack);
+      return angle + copysign(travel, distance);
+    }
+    /* Speed unknown: anywhere between the measurement and as far towards
+     * the goal as the joint could have got */
+    travel = fmin(fabs(distance), _maxSpeed * elapsed / 1000.0);
+    bound = LINKBOT_ESTIMATE_ERROR + travel / 2;
+    return angle + copysign(travel / 2, distance);
+  }
+  if((_still & (1 << joint)) && (long)(_robot->_motionAt - _prevAt) < 0) {
+    bound = LINKBOT_ESTIMATE_ERROR;
+    return angle;
+  }
+  bound = LINKBOT_ESTIMATE_ERROR + _maxSpeed * (long)(now - _at) / 1000.0;
+  return angle;
+}
+
+int LinkbotEstimator::estimate(float &angle1, float &angle2, float &angle3, float &bound)
+{
+  unsigned long now = millis();
+  float bounds[3];
+  if(!_measured) {
+    return -1;
+  }
+  angle1 = predict(0, now, bounds[0]);
+  angle2 = predict(1, now, bounds[1]);
+  angle3 = predict(2, now, bounds[2]);
+  bound = fmax(bounds[0], fmax(bounds[1], bounds[2]));
+  return 0;
+}
+
+int LinkbotEstimator::getJointAngles(float &angle1, float &angle2, float &angle3, float tolerance)
+{
+  float bound;
+  if(estimate(angle1, angle2, angle3, bound) == 0 && bound <= tolerance) {
+    _predicted++;
+    return 0;
+  }
+  if(measure()) {
+    return -1;
+  }
+  angle1 = _angles[0];
+  angle2 = _angles[1];
+  angle3 = _angles[2];
+  return 1;
+}
+
+void LinkbotEstimator::getStats(unsigned long &predicted, unsigned long &measured)
+{
+  predicted = _predicted;
+  measured = _measurements;
+}
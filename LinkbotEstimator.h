@@ -0,0 +1,87 @@
+#ifndef _LINKBOT_ESTIMATOR_H_
+#define _LINKBOT_ESTIMATOR_H_
+
+#include "Linkbot.h"
+
+/* The fastest a joint may turn, in degrees/second, assumed while its
+ * speed is not known */
+#ifndef LINKBOT_MAX_JOINT_SPEED
+#define LINKBOT_MAX_JOINT_SPEED 240
+#endif
+
+/* How far off a measured angle may be, in degrees */
+#ifndef LINKBOT_ESTIMATE_ERROR
+#define LINKBOT_ESTIMATE_ERROR 0.5
+#endif
+
+/* How long a commanded motion may take to start, in milliseconds */
+#ifndef LINKBOT_ESTIMATE_LAG
+#define LINKBOT_ESTIMATE_LAG 50
+#endif
+
+/**
+ * The LinkbotEstimator Class.
+ * Predicts a robot's joint angles between measurements, for example::
+
+      LinkbotEstimator estimator(robot);
+
+      void loop() {
+        float a1, a2, a3;
+        // Measures only when the prediction may be off by over 2 degrees
+        estimator.getJointAngles(a1, a2, a3, 2.0);
+        drawArm(a1, a2, a3);
+      }
+
+  The prediction starts from the last measured angles. A joint sent to a
+  goal with moveToNB(), driveToNB(), moveJointToNB() or driveJointToNB()
+  is taken to turn towards it at the speed last set with setJointSpeed(),
+  setJointSpeeds() or setJointStates(). A joint measured twice at the same
+  angle with no motion commanded in between is taken to be still. Any
+  other joint may be anywhere it could have reached at
+  LINKBOT_MAX_JOINT_SPEED. Each prediction comes with a bound on how far
+  off it may be, which grows with the time since the last measurement.
+
+  The commands must be sent through the robot the estimator was made with
+  for it to know about them.
+ */
+class LinkbotEstimator {
+  public:
+    LinkbotEstimator(Linkbot &robot, float maxSpeed = LINKBOT_MAX_JOINT_SPEED);
+
+    /** Measure the joint angles. */
+    int measure();
+
+    /**
+     * Predict the joint angles without asking the robot. bound is set to
+     * how far off any of them may be, in degrees. Returns -1 if the angles
+     * have never been measured.
+     */
+    int estimate(float &angle1, float &angle2, float &angle3, float &bound);
+
+    /**
+     * Get the joint angles, measuring them only if the prediction may be
+     * off by more than tolerance degrees. Returns 1 if they were measured,
+     * 0 if predicted, or -1 on failure.
+     */
+    int getJointAngles(float &angle1, float &angle2, float &angle3, float tolerance);
+
+    /**
+     * Get how many getJointAngles() calls were answered by a prediction
+     * and how many needed a measurement.
+     */
+    void getStats(unsigned long &predicted, unsigned long &measured);
+
+  private:
+    float predict(int joint, unsigned long now, float &bound);
+    Linkbot *_robot;
+    float _maxSpeed;
+    float _angles[3];
+    unsigned long _at;
+    unsigned long _prevAt;
+    uint8_t _measured;
+    uint8_t _still;
+    unsigned long _predicted;
+    unsigned long _measurements;
+};
+
+#endif
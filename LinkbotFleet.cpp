@@ -0,0 +1,147 @@
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include "LinkbotFleet.h"
+
+#define FLEET_MAGIC0 'L'
+#define FLEET_MAGIC1 'F'
+#define FLEET_LAYOUT_VERSION 1
+#define FLEET_HEADER_SIZE 4
+
+#define EEPTR(addr) ((uint8_t*)(uintptr_t)(addr))
+
+LinkbotFleet::LinkbotFleet(LinkbotDiscovery &discovery, int eeprom_addr)
+{
+  _discovery = &discovery;
+  _eeprom_addr = eeprom_addr;
+  _count = 0;
+}
+
+int LinkbotFleet::begin(unsigned long timeout)
+{
+  int i;
+  if(load() > 0 && validate() == 0) {
+    for(i = 0; i < _count; i++) {
+      _discovery->insert(LinkbotDiscovery::serialKey(_entries[i].serial),
+                         _entries[i].zigbee_addr);
+    }
+    return _count;
+  }
+  return refresh(timeout);
+}
+
+int LinkbotFleet::load()
+{
+  uint8_t header[FLEET_HEADER_SIZE];
+  eeprom_read_block(header, EEPTR(_eeprom_addr), FLEET_HEADER_SIZE);
+  if(header[0] != FLEET_MAGIC0 ||
+     header[1] != FLEET_MAGIC1 ||
+     header[2] != FLEET_LAYOUT_VERSION ||
+     header[3] > LINKBOT_FLEET_SIZE)
+  {
+    _count = 0;
+    return -1;
+  }
+  _count = header[3];
+  eeprom_read_block(_entries,
+                    EEPTR(_eeprom_addr + FLEET_HEADER_SIZE),
+                    _count * sizeof(linkbotFleetEntry_t));
+  if(eeprom_read_byte(EEPTR(_eeprom_addr + FLEET_HEADER_SIZE +
+                            _count * sizeof(linkbotFleetEntry_t))) != checksum())
+  {
+    _count = 0;
+    return -1;
+  }
+  return _count;
+}
+
+int LinkbotFleet::save()
+{
+  uint8_t header[FLEET_HEADER_SIZE];
+  header[0] = FLEET_MAGIC0;
+  header[1] = FLEET_MAGIC1;
+  header[2] = FLEET_LAYOUT_VERSION;
+  header[3] = _count;
+  eeprom_update_block(header, EEPTR(_eeprom_addr), FLEET_HEADER_SIZE);
+  eeprom_update_block(_entries,
+                      EEPTR(_eeprom_addr + FLEET_HEADER_SIZE),
+                      _count * sizeof(linkbotFleetEntry_t));
+  eeprom_update_byte(EEPTR(_eeprom_addr + FLEET_HEADER_SIZE +
+                           _count * sizeof(linkbotFleetEntry_t)),
+                     checksum());
+  return 0;
+}
+
+int LinkbotFleet::validate(unsigned long timeout)
+{
+  uint16_t addrs[LINKBOT_FLEET_SIZE];
+  uint8_t alive[LINKBOT_FLEET_SIZE];
+  int i;
+  for(i = 0; i < _count; i++) {
+    addrs[i] = _entries[i].zigbee_addr;
+  }
+  return _count - Linkbot::checkStatusAll(addrs, _count, alive, timeout);
+}
+
+int LinkbotFleet::refresh(unsigned long timeout)
+{
+  uint32_t serial;
+  uint16_t addr;
+  int form;
+  int version;
+  int i;
+  /* Start from an empty table, so robots which have left are dropped */
+  _discovery->clear();
+  if(_discovery->scan(timeout) < 0) {
+    return -1;
+  }
+  _count = 0;
+  for(i = 0; i < LINKBOT_DISCOVERY_CAPACITY && _count < LINKBOT_FLEET_SIZE; i++) {
+    if(_discovery->get(i, serial, addr)) {
+      continue;
+    }
+    Linkbot robot(addr);
+    linkbotFleetEntry_t *entry = &_entries[_count];
+    entry->zigbee_addr = addr;
+    entry->serial[0] = serial >> 24;
+    entry->serial[1] = serial >> 16;
+    entry->serial[2] = serial >> 8;
+    entry->serial[3] = serial;
+    entry->form_factor = robot.getFormFactor(form) ? MOBOTFORM_NULL : form;
+    entry->version = robot.getVersion(version) ? 0 : version;
+    _count++;
+  }
+  save();
+  return _count;
+}
+
+int LinkbotFleet::count()
+{
+  return _count;
+}
+
+int LinkbotFleet::get(int index, linkbotFleetEntry_t &entry)
+{
+  if(index < 0 || index >= _count) {
+    return -1;
+  }
+  entry = _entries[index];
+  return 0;
+}
+
+uint8_t LinkbotFleet::checksum()
+{
+  const uint8_t *bytes = (const uint8_t*)_entries;
+  uint8_t crc = 0;
+  int i;
+  crc = _crc8_ccitt_update(crc, FLEET_MAGIC0);
+  crc = _crc8_ccitt_update(crc, FLEET_MAGIC1);
+  crc = _crc8_ccitt_update(crc, FLEET_LAYOUT_VERSION);
+  crc = _crc8_ccitt_update(crc, _count);
+  for(i = 0; i < _count * (int)sizeof(linkbotFleetEntry_t); i++) {
+    crc = _crc8_ccitt_update(crc, bytes[i]);
+  }
+  return crc;
+}
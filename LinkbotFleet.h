@@ -0,0 +1,92 @@
+#ifndef _LINKBOT_FLEET_H_
+#define _LINKBOT_FLEET_H_
+
+#include "Linkbot.h"
+#include "LinkbotDiscovery.h"
+
+/* The largest number of robots remembered across resets */
+#ifndef LINKBOT_FLEET_SIZE
+#define LINKBOT_FLEET_SIZE 16
+#endif
+
+/* The EEPROM address the fleet is stored at. The fleet occupies
+ * 5 + 8*LINKBOT_FLEET_SIZE bytes. */
+#ifndef LINKBOT_FLEET_EEPROM_ADDR
+#define LINKBOT_FLEET_EEPROM_ADDR 0
+#endif
+
+/**
+ * A remembered robot, as stored in EEPROM. */
+typedef struct linkbotFleetEntry_s
+{
+  uint16_t zigbee_addr;
+  uint8_t serial[4];
+  uint8_t form_factor;
+  uint8_t version;
+} linkbotFleetEntry_t;
+
+/**
+ * The LinkbotFleet Class.
+ * Remembers the robots found by a LinkbotDiscovery in EEPROM, so that after a
+ * reset the fleet can be brought back up without a full discovery.
+
+  EEPROM layout, starting at LINKBOT_FLEET_EEPROM_ADDR::
+
+      [2 bytes magic 'L' 'F'] [1 byte layout version] [1 byte count]
+      [count * 8 bytes linkbotFleetEntry_t] [1 byte CRC-8 of all preceding bytes]
+
+  On a warm start, begin() loads the stored fleet and checks every stored
+  robot with a single checkStatusAll() sweep. Only if the stored fleet is
+  missing, corrupt, or any robot fails to answer is a full discovery run.
+ */
+class LinkbotFleet {
+  public:
+    LinkbotFleet(LinkbotDiscovery &discovery, int eeprom_addr = LINKBOT_FLEET_EEPROM_ADDR);
+
+    /**
+     * Bring the fleet up. Tries a warm start from EEPROM first, and falls
+     * back to refresh() if it fails. The discovery's table is filled with
+     * the fleet either way. Returns the number of robots, or -1 on failure.
+     * @param timeout the time in milliseconds to spend on discovery if it is
+     * needed
+     */
+    int begin(unsigned long timeout = 2000);
+
+    /**
+     * Load the fleet from EEPROM. Returns the number of robots, or -1 if no
+     * valid fleet is stored.
+     */
+    int load();
+
+    /** Write the fleet to EEPROM. Only bytes which changed are written. */
+    int save();
+
+    /**
+     * Check that every robot in the fleet still responds. Returns the number
+     * of robots which did not respond.
+     */
+    int validate(unsigned long timeout = 500);
+
+    /**
+     * Run a full discovery, read each robot's form factor and firmware
+     * version, and save the result. The discovery's table is cleared first,
+     * so robots which do not answer this scan are dropped from the fleet.
+     * Returns the number of robots, or -1 on failure.
+     */
+    int refresh(unsigned long timeout = 2000);
+
+    /** Get the number of robots in the fleet. */
+    int count();
+
+    /** Get a robot in the fleet. Returns -1 if index is out of range. */
+    int get(int index, linkbotFleetEntry_t &entry);
+
+  private:
+    uint8_t checksum();
+    LinkbotDiscovery *_discovery;
+    int _eeprom_addr;
+    linkbotFleetEntry_t _entries[LINKBOT_FLEET_SIZE];
+    uint8_t _count;
+};
+
+#endif
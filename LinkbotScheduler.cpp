@@ -0,0 +1,108 @@
+
+#include <Arduino.h>
+
+#include "LinkbotScheduler.h"
+
+#define TASK_USED    0x01
+#define TASK_RUNNING 0x02
+
+typedef struct taskEntry_s {
+  linkbotTaskFunc_t func;
+  void *context;
+  linkbotTask_t task;
+  uint8_t flags;
+} taskEntry_t;
+
+static taskEntry_t g_tasks[LINKBOT_MAX_TASKS];
+
+/* How many yield() calls are on the stack */
+static uint8_t g_depth = 0;
+
+int LinkbotScheduler::add(linkbotTaskFunc_t func, void *context)
+{
+  int i;
+  for(i = 0; i < LINKBOT_MAX_TASKS; i++) {
+    if(g_tasks[i].flags == 0) {
+      g_tasks[i].func = func;
+      g_tasks[i].context = context;
+      g_tasks[i].task.lc = 0;
+      g_tasks[i].task.wake = 0;
+      g_tasks[i].flags = TASK_USED;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int LinkbotScheduler::remove(int id)
+{
+  if(id < 0 || id >= LINKBOT_MAX_TASKS || !(g_tasks[id].flags & TASK_USED)) {
+    return -1;
+  }
+  /* A task removed while blocked is freed when it returns */
+  g_tasks[id].flags &= ~TASK_USED;
+  return 0;
+}
+
+int LinkbotScheduler::isRunning(int id)
+{
+  if(id < 0 || id >= LINKBOT_MAX_TASKS) {
+    return 0;
+  }
+  return (g_tasks[id].flags & TASK_USED) ? 1 : 0;
+}
+
+int LinkbotScheduler::count()
+{
+  int i;
+  int n = 0;
+  for(i = 0; i < LINKBOT_MAX_TASKS; i++) {
+    if(g_tasks[i].flags & TASK_USED) {
+      n++;
+    }
+  }
+  return n;
+}
+
+int LinkbotScheduler::runOnce()
+{
+  int i;
+  char rc;
+  for(i = 0; i < LINKBOT_MAX_TASKS; i++) {
+    taskEntry_t *entry = &g_tasks[i];
+    /* Blocked tasks are further up the stack; skip them */
+    if(entry->flags != TASK_USED) {
+      continue;
+    }
+    entry->flags |= TASK_RUNNING;
+    rc = entry->func(&entry->task, entry->context);
+    entry->flags &= ~TASK_RUNNING;
+    if(rc == LB_TASK_DONE) {
+      entry->flags = 0;
+    }
+  }
+  return count();
+}
+
+void LinkbotScheduler::run()
+{
+  while(runOnce() > 0);
+}
+
+void LinkbotScheduler::yield()
+{
+  if(g_depth >= LINKBOT_MAX_TASK_DEPTH) {
+    return;
+  }
+  g_depth++;
+  runOnce();
+  g_depth--;
+}
+
+void LinkbotScheduler::sleep(unsigned long ms)
+{
+  unsigned long startMillis = millis();
+  while((millis() - startMillis) < ms) {
+    yield();
+  }
+}
@@ -0,0 +1,152 @@
+#ifndef _LINKBOT_SCHEDULER_H_
+#define _LINKBOT_SCHEDULER_H_
+
+#include <stdint.h>
+
+/* The most tasks which may be added at once */
+#ifndef LINKBOT_MAX_TASKS
+#define LINKBOT_MAX_TASKS 8
+#endif
+
+/* The most tasks which may be blocked in yield() at once, each nested on
+ * the stack above the last */
+#ifndef LINKBOT_MAX_TASK_DEPTH
+#define LINKBOT_MAX_TASK_DEPTH 3
+#endif
+
+/* Task function return values */
+#define LB_TASK_WAITING 0
+#define LB_TASK_DONE    1
+
+/**
+ * The state of a task. Tasks are stackless, so any variable which must keep
+ * its value across LB_TASK_YIELD(), LB_TASK_WAIT_UNTIL() or LB_TASK_SLEEP()
+ * must live in the task's context rather than on the stack. */
+typedef struct linkbotTask_s
+{
+  uint16_t lc;          /* where to resume the task function */
+  unsigned long wake;   /* deadline of LB_TASK_SLEEP() */
+} linkbotTask_t;
+
+typedef char (*linkbotTaskFunc_t)(linkbotTask_t *task, void *context);
+
+/*
+ * Task function macros. A task function is written as straight-line code
+ * between LB_TASK_BEGIN() and LB_TASK_END(); each wait macro returns to the
+ * scheduler and resumes at the same point on the next run. Wait macros may
+ * not be used inside a switch statement.
+ */
+#define LB_TASK_BEGIN(task) switch((task)->lc) { case 0:
+
+#define LB_TASK_YIELD(task) \
+  do { (task)->lc = __LINE__; return LB_TASK_WAITING; case __LINE__:; } while(0)
+
+#define LB_TASK_WAIT_UNTIL(task, condition) \
+  do { (task)->lc = __LINE__; case __LINE__: \
+    if(!(condition)) { return LB_TASK_WAITING; } } while(0)
+
+#define LB_TASK_SLEEP(task, ms) \
+  do { (task)->wake = millis() + (ms); \
+    LB_TASK_WAIT_UNTIL(task, (long)(millis() - (task)->wake) >= 0); } while(0)
+
+/* Wait until robot, a Linkbot*, has finished its motion, without holding
+ * up the other tasks. Also ends if the robot can't be asked; see
+ * Linkbot::pollMoveDone(). */
+#define LB_TASK_MOVE_WAIT(task, robot) \
+  LB_TASK_WAIT_UNTIL(task, (robot)->pollMoveDone() != 0)
+
+#define LB_TASK_END(task) } (task)->lc = 0; return LB_TASK_DONE;
+
+/**
+ * The LinkbotScheduler Class.
+ * A cooperative scheduler for running several robot behaviours on one
+ * Arduino. Each behaviour is a task function written with the LB_TASK_
+ * macros, for example::
+
+      char wave(linkbotTask_t *task, void *context)
+      {
+        Linkbot *robot = (Linkbot*)context;
+        LB_TASK_BEGIN(task);
+        while(1) {
+          robot->moveToNB(90, 0, 0);
+          LB_TASK_MOVE_WAIT(task, robot);
+          robot->moveToNB(0, 0, 0);
+          LB_TASK_MOVE_WAIT(task, robot);
+          LB_TASK_SLEEP(task, 500);
+        }
+        LB_TASK_END(task);
+      }
+
+      void setup() {
+        LinkbotScheduler::add(wave, &robot1);
+        LinkbotScheduler::add(wave, &robot2);
+      }
+
+      void loop() {
+        LinkbotScheduler::runOnce();
+      }
+
+  A task waits with the wait macros and the Linkbot calls which return at
+  once: the NB motion functions with LB_TASK_MOVE_WAIT(), or
+  requestJointAngles() with pollJointAngles(), for example::
+
+      robot->requestJointAngles();
+      LB_TASK_WAIT_UNTIL(task, robot->pollJointAngles(a1, a2, a3) != 0);
+
+  where a1, a2 and a3 live in the task's context. Waiting this way, both
+  robots above move at once, and each pass of the loop takes as long as
+  the slowest robot's motion rather than the sum of them. Each robot should
+  be driven by one task at a time.
+
+  Blocking Linkbot functions, such as moveTo(), may be called from a task
+  too, and run the other tasks through yield() while they wait for the
+  robot. This is not true concurrency: yield() runs the other tasks on the
+  blocked task's own stack, so a task which blocks while another is
+  blocked is nested above it, and the one below can't return until every
+  task above it has finished its own blocking call, even if its response
+  came long before. Each level of nesting also costs the stack of a
+  blocking call, so at most LINKBOT_MAX_TASK_DEPTH tasks are nested; past
+  that, yield() returns without running anything and blocking calls simply
+  wait. A task is never re-entered while it is blocked, so each robot's
+  commands stay in order.
+
+  The task table is fixed in size and nothing is allocated from the heap.
+ */
+class LinkbotScheduler {
+  public:
+    /**
+     * Add a task. Returns the task's id, or -1 if the table is full. The
+     * task runs until its function reaches LB_TASK_END().
+     */
+    static int add(linkbotTaskFunc_t func, void *context);
+
+    /** Remove a task before it has finished. */
+    static int remove(int id);
+
+    /** Check whether a task is still in the table. */
+    static int isRunning(int id);
+
+    /** Get the number of tasks in the table. */
+    static int count();
+
+    /**
+     * Run every task which is not blocked once. Returns the number of
+     * tasks left.
+     */
+    static int runOnce();
+
+    /** Run the tasks until all of them have finished. */
+    static void run();
+
+    /**
+     * Let the other tasks run. Called by blocking functions while they wait,
+     * so that waiting on one robot overlaps with work for the others. Does
+     * nothing once LINKBOT_MAX_TASK_DEPTH tasks are blocked.
+     */
+    static void yield();
+
+    /** Wait for ms milliseconds, running the other tasks meanwhile. */
+    static void sleep(unsigned long ms);
+};
+
+#endif
@@ -0,0 +1,386 @@
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <math.h>
+
+#include "LinkbotScript.h"
+#include "LinkbotScheduler.h"
+extern "C" {
+#include "utility/framing.h"
+}
+
+#define EEPTR(addr) ((uint8_t*)(uintptr_t)(addr))
+
+/* Where the script is */
+#define SOURCE_RAM     0
+#define SOURCE_PROGMEM 1
+#define SOURCE_EEPROM  2
+
+#define STATE_IDLE    0
+#define STATE_RUNNING 1
+#define STATE_FAILED  2
+
+/* The bounds on how often waits look at the robot, in milliseconds */
+#define SCRIPT_POLL_MIN 20
+#define SCRIPT_POLL_MAX 100
+
+static char scriptTask(linkbotTask_t *task, void *context)
+{
+  LinkbotScript *script = (LinkbotScript*)context;
+  return (script->step() > 0) ? LB_TASK_WAITING : LB_TASK_DONE;
+}
+
+LinkbotScript::LinkbotScript(Linkbot &robot)
+{
+  _robot = &robot;
+  _program = NULL;
+  _eeprom = 0;
+  _source = SOURCE_RAM;
+  _state = STATE_IDLE;
+  _length = 0;
+  _pc = 0;
+  _errorAt = -1;
+  _speedsKnown = 0;
+  _lead = LINKBOT_SCRIPT_LEAD;
+}
+
+void LinkbotScript::load(const uint8_t *program, int length)
+{
+  _program = program;
+  _source = SOURCE_RAM;
+  _length = length;
+  _pc = 0;
+  _errorAt = -1;
+  /* The speeds a previous script set may have changed since */
+  _speedsKnown = 0;
+  _state = STATE_RUNNING;
+}
+
+void LinkbotScript::loadProgmem(const uint8_t *program, int length)
+{
+  load(program, length);
+  _source = SOURCE_PROGMEM;
+}
+
+void LinkbotScript::loadEeprom(int addr, int length)
+{
+  load(NULL, length);
+  _eeprom = addr;
+  _source = SOURCE_EEPROM;
+}
+
+/* Read a byte from a serial port. Returns -1 if none comes by deadline. */
+static int serialRead(Stream &serial, unsigned long start, unsigned long timeout)
+{
+  while(serial.available() <= 0) {
+    if((millis() - start) > timeout) {
+      return -1;
+    }
+    LinkbotScheduler::yield();
+  }
+  return serial.read();
+}
+
+int LinkbotScript::loadSerial(Stream &serial, uint8_t *buffer, int size, unsigned long timeout)
+{
+  unsigned long start = millis();
+  uint8_t crc = 0;
+  int length;
+  int c;
+  int i;
+  _state = STATE_IDLE;
+  if((c = serialRead(serial, start, timeout)) < 0) {
+    return -1;
+  }
+  length = c << 8;
+  if((c = serialRead(serial, start, timeout)) < 0) {
+    return -1;
+  }
+  length |= c;
+  if(length > size) {
+    return -1;
+  }
+  for(i = 0; i < length; i++) {
+    if((c = serialRead(serial, start, timeout)) < 0) {
+      return -1;
+    }
+    buffer[i] = c;
+    crc = framing_crc8(crc, &buffer[i], 1);
+  }
+  if((c = serialRead(serial, start, timeout)) < 0 || c != crc) {
+    return -1;
+  }
+  load(buffer, length);
+  return 0;
+}
+
+/* Read the next byte of the script, or -1 past its end. Reading past the
+ * end leaves _pc past it too, so a cut-off instruction is caught. */
+int LinkbotScript::fetch()
+{
+  int pc = _pc;
+  if(pc < 0 || pc >= _length) {
+    _pc = _length + 1;
+    return -1;
+  }
+  _pc++;
+  switch(_source) {
+    case SOURCE_PROGMEM:
+      return pgm_read_byte(&_program[pc]);
+    case SOURCE_EEPROM:
+      return eeprom_read_byte(EEPTR(_eeprom + pc));
+  }
+  return _program[pc];
+}
+
+/* Read a signed 16-bit operand */
+int LinkbotScript::fetch16()
+{
+  int hi = fetch();
+  int lo = fetch();
+  return (int16_t)(((hi & 0xff) << 8) | (lo & 0xff));
+}
+
+int LinkbotScript::step()
+{
+  int start = _pc;
+  int op;
+  int a, b, c;
+  int rc = 0;
+  if(_state != STATE_RUNNING) {
+    return (_state == STATE_FAILED) ? -1 : 0;
+  }
+  if(_pc == _length) {
+    _state = STATE_IDLE;
+    return 0;
+  }
+  op = fetch();
+  switch(op) {
+    case SCRIPT_END:
+      _state = STATE_IDLE;
+      return 0;
+    case SCRIPT_MOVETO:
+    case SCRIPT_MOVE:
+    case SCRIPT_DRIVETO:
+      a = fetch16();
+      b = fetch16();
+      c = fetch16();
+      if(op == SCRIPT_MOVETO) {
+        rc = _robot->moveToNB(a / 10.0, b / 10.0, c / 10.0);
+      } else if(op == SCRIPT_MOVE) {
+        rc = _robot->moveNB(a / 10.0, b / 10.0, c / 10.0);
+      } else {
+        rc = _robot->driveToNB(a / 10.0, b / 10.0, c / 10.0);
+      }
+      break;
+    case SCRIPT_MOVEWAIT:
+      rc = moveWait();
+      break;
+    case SCRIPT_SLEEP:
+      LinkbotScheduler::sleep((uint16_t)fetch16());
+      break;
+    case SCRIPT_LED:
+      a = fetch();
+      b = fetch();
+      c = fetch();
+      rc = _robot->setLEDColor(a, b, c);
+      break;
+    case SCRIPT_BUZZER:
+      rc = _robot->setBuzzerFrequency((uint16_t)fetch16());
+      break;
+    case SCRIPT_SPEEDS:
+      _speeds[0] = fetch16();
+      _speeds[1] = fetch16();
+      _speeds[2] = fetch16();
+      rc = _robot->setJointSpeeds(_speeds[0], _speeds[1], _speeds[2]);
+      _speedsKnown = (rc == 0);
+      break;
+    case SCRIPT_POWERS:
+      a = fetch16();
+      b = fetch16();
+      c = fetch16();
+      rc = _robot->setMotorPowers(a, b, c);
+      break;
+    case SCRIPT_STOP:
+      rc = _robot->stop();
+      break;
+    case SCRIPT_SET:
+      a = fetch();
+      b = fetch16();
+      if(a < 0 || a >= LINKBOT_SCRIPT_COUNTERS) {
+        rc = -1;
+        break;
+      }
+      _counters[a] = b;
+      break;
+    case SCRIPT_LOOP:
+      a = fetch();
+      b = fetch16();
+      if(a < 0 || a >= LINKBOT_SCRIPT_COUNTERS) {
+        rc = -1;
+        break;
+      }
+      if(_counters[a] > 0 && --_counters[a] > 0) {
+        _pc += b;
+      }
+      break;
+    case SCRIPT_JUMP:
+      b = fetch16();
+      _pc += b;
+      break;
+    case SCRIPT_WAITUNTIL:
+      a = fetch();
+      b = fetch();
+      c = fetch16();
+      rc = waitUntil(a, b, c / 10.0);
+      break;
+    case SCRIPT_POSE:
+      rc = _robot->moveToPoseNB(fetch());
+      break;
+    default:
+      rc = -1;
+      break;
+  }
+  /* An operand ran past the end of the script */
+  if(_pc > _length) {
+    rc = -1;
+  }
+  if(rc) {
+    _errorAt = start;
+    _state = STATE_FAILED;
+    return -1;
+  }
+  return 1;
+}
+
+int LinkbotScript::run()
+{
+  int rc;
+  while((rc = step()) > 0);
+  return rc;
+}
+
+int LinkbotScript::start()
+{
+  if(_state != STATE_RUNNING) {
+    return -1;
+  }
+  return LinkbotScheduler::add(scriptTask, this);
+}
+
+void LinkbotScript::stop()
+{
+  if(_state == STATE_RUNNING) {
+    _state = STATE_IDLE;
+  }
+}
+
+int LinkbotScript::isRunning()
+{
+  return _state == STATE_RUNNING;
+}
+
+int LinkbotScript::errorAt()
+{
+  return _errorAt;
+}
+
+void LinkbotScript::setLead(unsigned long ms)
+{
+  _lead = ms;
+}
+
+/* Wait for the current motion to finish. If the next instruction is
+ * another motion, release it shortly before the motion should end. */
+int LinkbotScript::moveWait()
+{
+  Linkbot *robots[1] = { _robot };
+  float errors[3];
+  float remaining;
+  float last = -1;
+  int pc = _pc;
+  int next;
+  int moving;
+  int i;
+  /* Peek at the next instruction */
+  next = (pc < _length) ? fetch() : SCRIPT_END;
+  _pc = pc;
+  if(!_speedsKnown || (next != SCRIPT_MOVETO && next != SCRIPT_MOVE &&
+                       next != SCRIPT_DRIVETO && next != SCRIPT_POSE)) {
+    return Linkbot::waitAll(robots, 1);
+  }
+  while(1) {
+    if(_robot->getMotorErrors(errors[0], errors[1], errors[2])) {
+      return -1;
+    }
+    /* Time left in milliseconds, going by the slowest joint */
+    remaining = 0;
+    for(i = 0; i < 3; i++) {
+      if(_speeds[i] > 0) {
+        remaining = fmax(remaining, fabs(errors[i]) * 1000.0 / _speeds[i]);
+      }
+    }
+    if(remaining <= _lead) {
+      return 0;
+    }
+    /* Not closing in on the goal; stalled, or moving some other way */
+    if(last >= 0 && remaining >= last) {
+      moving = _robot->isMoving();
+      if(moving <= 0) {
+        return moving;
+      }
+    }
+    last = remaining;
+    remaining -= _lead;
+    if(remaining < SCRIPT_POLL_MIN) {
+      remaining = SCRIPT_POLL_MIN;
+    } else if(remaining > SCRIPT_POLL_MAX) {
+      remaining = SCRIPT_POLL_MAX;
+    }
+    LinkbotScheduler::sleep((unsigned long)remaining);
+  }
+}
+
+int LinkbotScript::readChannel(uint8_t channel, float &value)
+{
+  float values[3];
+  float magnitude;
+  int rc;
+  if(channel <= LB_WATCH_JOINT3) {
+    rc = _robot->getJointAngles(values[0], values[1], values[2]);
+    value = values[channel - LB_WATCH_JOINT1];
+    return rc;
+  }
+  if(channel == LB_WATCH_BATTERY) {
+    return _robot->getBatteryVoltage(value);
+  }
+  if(channel > LB_WATCH_TILT) {
+    return -1;
+  }
+  if(_robot->getAccelerometerData(values[0], values[1], values[2])) {
+    return -1;
+  }
+  if(channel == LB_WATCH_TILT) {
+    magnitude = sqrt(values[0]*values[0] + values[1]*values[1] + values[2]*values[2]);
+    value = (magnitude > 0) ? acos(values[2] / magnitude) * 180.0 / M_PI : 0;
+  } else {
+    value = values[channel - LB_WATCH_ACCEL_X];
+  }
+  return 0;
+}
+
+int LinkbotScript::waitUntil(uint8_t channel, uint8_t comparator, float threshold)
+{
+  float value;
+  while(_state == STATE_RUNNING) {
+    if(readChannel(channel, value)) {
+      return -1;
+    }
+    if((comparator == LB_WATCH_ABOVE) ? (value > threshold) : (value < threshold)) {
+      return 0;
+    }
+    LinkbotScheduler::sleep(SCRIPT_POLL_MIN);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+#ifndef _LINKBOT_SCRIPT_H_
+#define _LINKBOT_SCRIPT_H_
+
+#include <Arduino.h>
+
+#include "Linkbot.h"
+#include "LinkbotWatcher.h"
+
+/* The number of loop counters a script has */
+#ifndef LINKBOT_SCRIPT_COUNTERS
+#define LINKBOT_SCRIPT_COUNTERS 4
+#endif
+
+/* How long before a motion ends the next motion is sent, in milliseconds,
+ * when the joint speeds are known; see SCRIPT_MOVEWAIT */
+#ifndef LINKBOT_SCRIPT_LEAD
+#define LINKBOT_SCRIPT_LEAD 30
+#endif
+
+/*
+ * Script opcodes. Operands follow the opcode; 16-bit operands are msb
+ * first, and angles are in tenths of a degree. Jumps are relative to the
+ * start of the next instruction. The size of each instruction in bytes is
+ * given in brackets.
+ */
+#define SCRIPT_END       0x00 /* [1] stop the script */
+#define SCRIPT_MOVETO    0x01 /* [7] int16 angle1, angle2, angle3: moveToNB() */
+#define SCRIPT_MOVE      0x02 /* [7] int16 angle1, angle2, angle3: moveNB() */
+#define SCRIPT_DRIVETO   0x03 /* [7] int16 angle1, angle2, angle3: driveToNB() */
+#define SCRIPT_MOVEWAIT  0x04 /* [1] wait for the motion to finish */
+#define SCRIPT_SLEEP     0x05 /* [3] uint16 milliseconds */
+#define SCRIPT_LED       0x06 /* [4] uint8 r, g, b: setLEDColor() */
+#define SCRIPT_BUZZER    0x07 /* [3] uint16 Hz: setBuzzerFrequency() */
+#define SCRIPT_SPEEDS    0x08 /* [7] int16 degrees/second x3: setJointSpeeds() */
+#define SCRIPT_POWERS    0x09 /* [7] int16 power x3: setMotorPowers() */
+#define SCRIPT_STOP      0x0A /* [1] stop() */
+#define SCRIPT_SET       0x0B /* [4] uint8 counter, uint16 value */
+#define SCRIPT_LOOP      0x0C /* [4] uint8 counter, int16 jump: decrement the
+                                 counter and jump unless it reached 0 */
+#define SCRIPT_JUMP      0x0D /* [3] int16 jump */
+#define SCRIPT_WAITUNTIL 0x0E /* [5] uint8 LB_WATCH_ channel, uint8
+                                 LB_WATCH_ABOVE or LB_WATCH_BELOW, int16
+                                 threshold in tenths: wait until it holds */
+#define SCRIPT_POSE      0x0F /* [2] uint8 index: moveToPoseNB() */
+
+/* Helpers for writing scripts as byte arrays */
+#define LB_S16(v) (uint8_t)(((int)(v)) >> 8), (uint8_t)((int)(v))
+#define LB_TENTHS(v) LB_S16((v) * 10)
+#define LB_SCRIPT_END()                 SCRIPT_END
+#define LB_SCRIPT_MOVETO(a1, a2, a3)    SCRIPT_MOVETO, LB_TENTHS(a1), LB_TENTHS(a2), LB_TENTHS(a3)
+#define LB_SCRIPT_MOVE(a1, a2, a3)      SCRIPT_MOVE, LB_TENTHS(a1), LB_TENTHS(a2), LB_TENTHS(a3)
+#define LB_SCRIPT_DRIVETO(a1, a2, a3)   SCRIPT_DRIVETO, LB_TENTHS(a1), LB_TENTHS(a2), LB_TENTHS(a3)
+#define LB_SCRIPT_MOVEWAIT()            SCRIPT_MOVEWAIT
+#define LB_SCRIPT_SLEEP(ms)             SCRIPT_SLEEP, LB_S16(ms)
+#define LB_SCRIPT_LED(r, g, b)          SCRIPT_LED, (r), (g), (b)
+#define LB_SCRIPT_BUZZER(hz)            SCRIPT_BUZZER, LB_S16(hz)
+#define LB_SCRIPT_SPEEDS(s1, s2, s3)    SCRIPT_SPEEDS, LB_S16(s1), LB_S16(s2), LB_S16(s3)
+#define LB_SCRIPT_POWERS(p1, p2, p3)    SCRIPT_POWERS, LB_S16(p1), LB_S16(p2), LB_S16(p3)
+#define LB_SCRIPT_STOP()                SCRIPT_STOP
+#define LB_SCRIPT_SET(counter, value)   SCRIPT_SET, (counter), LB_S16(value)
+#define LB_SCRIPT_LOOP(counter, jump)   SCRIPT_LOOP, (counter), LB_S16(jump)
+#define LB_SCRIPT_JUMP(jump)            SCRIPT_JUMP, LB_S16(jump)
+#define LB_SCRIPT_WAITUNTIL(channel, comparator, threshold) \
+  SCRIPT_WAITUNTIL, (channel), (comparator), LB_TENTHS(threshold)
+#define LB_SCRIPT_POSE(index)           SCRIPT_POSE, (index)
+
+/**
+ * The LinkbotScript Class.
+ * Runs a motion script: a sequence of robot operations in a compact
+ * bytecode, which can be loaded from flash, EEPROM or the serial port
+ * without changing the sketch, for example::
+
+      const uint8_t wave[] PROGMEM = {
+        LB_SCRIPT_SPEEDS(90, 90, 90),
+        LB_SCRIPT_SET(0, 3),
+        LB_SCRIPT_LED(0, 0, 255),          // the loop starts here
+        LB_SCRIPT_MOVETO(90, 0, 0),
+        LB_SCRIPT_MOVEWAIT(),
+        LB_SCRIPT_MOVETO(0, 0, 0),
+        LB_SCRIPT_MOVEWAIT(),
+        LB_SCRIPT_LOOP(0, -(4 + 7 + 1 + 7 + 1 + 4)),
+        LB_SCRIPT_BUZZER(440),
+        LB_SCRIPT_SLEEP(200),
+        LB_SCRIPT_BUZZER(0),
+        LB_SCRIPT_END()
+      };
+
+      LinkbotScript script(robot);
+
+      void setup() {
+        script.loadProgmem(wave, sizeof(wave));
+        script.run();
+      }
+
+  Steps chain without dead time: when SCRIPT_MOVEWAIT is followed by
+  another motion and the joint speeds were set by the script, the wait
+  ends LINKBOT_SCRIPT_LEAD milliseconds before the motion is due to finish,
+  judging by how far the motors are from their goals, so the next motion
+  reaches the robot as the current one ends. Otherwise the wait polls as
+  Linkbot::waitAll() does.
+
+  A script can also run as a LinkbotScheduler task with start(), leaving
+  the sketch free to do other work.
+ */
+class LinkbotScript {
+  public:
+    LinkbotScript(Linkbot &robot);
+
+    /** Load a script from RAM. The script is not copied. */
+    void load(const uint8_t *program, int length);
+
+    /** Load a script from flash, declared PROGMEM. */
+    void loadProgmem(const uint8_t *program, int length);
+
+    /** Load a script from EEPROM. */
+    void loadEeprom(int addr, int length);
+
+    /**
+     * Receive a script over a serial port into buffer and load it. The
+     * script is sent as its length (2 bytes, msb first), the script, and a
+     * CRC-8 of the script. Returns 0 on success, or -1 if the script did
+     * not fit, timed out, or failed the CRC.
+     */
+    int loadSerial(Stream &serial, uint8_t *buffer, int size, unsigned long timeout = 2000);
+
+    /**
+     * Run the next instruction. Returns 1 if the script goes on, 0 once it
+     * has ended, or -1 if an instruction failed; errorAt() then gives its
+     * offset.
+     */
+    int step();
+
+    /** Run the script to the end. Returns 0 on success, or -1 on failure. */
+    int run();
+
+    /**
+     * Run the script as a LinkbotScheduler task. Returns the task's id, or
+     * -1 if it could not be added.
+     */
+    int start();
+
+    /** Stop the script after the current instruction. */
+    void stop();
+
+    /** Check whether the script has more to run. */
+    int isRunning();
+
+    /** Get the offset of the instruction which failed, or -1. */
+    int errorAt();
+
+    /** Set how early a motion may be chained onto the one before it. */
+    void setLead(unsigned long ms);
+
+  private:
+    int fetch();
+    int fetch16();
+    int moveWait();
+    int readChannel(uint8_t channel, float &value);
+    int waitUntil(uint8_t channel, uint8_t comparator, float threshold);
+    Linkbot *_robot;
+    const uint8_t *_program;
+    int _eeprom;
+    uint8_t _source;
+    uint8_t _state;
+    int _length;
+    int _pc;
+    int _errorAt;
+    uint16_t _counters[LINKBOT_SCRIPT_COUNTERS];
+    float _speeds[3];
+    uint8_t _speedsKnown;
+    unsigned long _lead;
+};
+
+#endif
@@ -0,0 +1,172 @@
+
+#include <Arduino.h>
+
+#include "LinkbotStream.h"
+#include "LinkbotScheduler.h"
+
+/* The pending setpoints, in the order they take turns to be sent */
+#define SP_ANGLES 0x01
+#define SP_SPEED1 0x02
+#define SP_SPEED2 0x04
+#define SP_SPEED3 0x08
+#define SP_POWERS 0x10
+#define SP_ALL    0x1f
+
+/* The setpoint after bit in turn */
+static uint8_t nextSetpoint(uint8_t bit)
+{
+  bit = (bit << 1) & SP_ALL;
+  return bit ? bit : SP_ANGLES;
+}
+
+LinkbotSetpointStream::LinkbotSetpointStream(Linkbot &robot)
+{
+  int i;
+  _robot = &robot;
+  for(i = 0; i < 3; i++) {
+    _angles[i] = 0;
+    _speeds[i] = 0;
+    /* Not a speed, so the first setJointSpeeds() always sends */
+    _sentSpeeds[i] = -1;
+    _powers[i] = 0;
+  }
+  _inflightSpeed = 0;
+  _pending = 0;
+  _inflight = 0;
+  _next = SP_ANGLES;
+  resetStats();
+}
+
+void LinkbotSetpointStream::moveTo(float angle1, float angle2, float angle3)
+{
+  if(_pending & SP_ANGLES) {
+    _stats.conflated++;
+  }
+  _angles[0] = angle1;
+  _angles[1] = angle2;
+  _angles[2] = angle3;
+  _pending |= SP_ANGLES;
+  update();
+}
+
+void LinkbotSetpointStream::setJointSpeeds(float speed1, float speed2, float speed3)
+{
+  float speeds[3] = {speed1, speed2, speed3};
+  uint8_t bit;
+  int i;
+  /* Each joint's speed is its own command, so only send those which
+   * changed */
+  for(i = 0; i < 3; i++) {
+    bit = SP_SPEED1 << i;
+    if(_pending & bit) {
+      _stats.conflated++;
+      _pending &= ~bit;
+    }
+    _speeds[i] = speeds[i];
+    if(speeds[i] != _sentSpeeds[i]) {
+      _pending |= bit;
+    }
+  }
+  update();
+}
+
+void LinkbotSetpointStream::setMotorPowers(int power1, int power2, int power3)
+{
+  if(_pending & SP_POWERS) {
+    _stats.conflated++;
+  }
+  _powers[0] = power1;
+  _powers[1] = power2;
+  _powers[2] = power3;
+  _pending |= SP_POWERS;
+  update();
+}
+
+int LinkbotSetpointStream::update()
+{
+  uint8_t bit;
+  int rc;
+  int i;
+  if(_inflight) {
+    if(_inflight == SP_ANGLES) {
+      rc = _robot->commandPoll(LBCMD_MOVETO);
+    } else if(_inflight == SP_POWERS) {
+      rc = _robot->commandPoll(LBCMD_SETMOTORPOWER);
+    } else {
+      rc = _robot->commandPoll(LBCMD_SETJOINTSPEED);
+    }
+    if(rc == 0) {
+      return pending();
+    }
+    if(rc < 0) {
+      _stats.errors++;
+    } else if(_inflight & (SP_SPEED1 | SP_SPEED2 | SP_SPEED3)) {
+      /* Only a speed the robot acknowledged counts as sent */
+      i = (_inflight == SP_SPEED1) ? 0 : (_inflight == SP_SPEED2) ? 1 : 2;
+      _sentSpeeds[i] = _inflightSpeed;
+    }
+    _inflight = 0;
+  }
+  if(_pending == 0) {
+    return 0;
+  }
+  /* Take turns, so a fast stream of one kind can't starve the others */
+  while(!(_pending & _next)) {
+    _next = nextSetpoint(_next);
+  }
+  bit = _next;
+  _next = nextSetpoint(bit);
+  _pending &= ~bit;
+  if(bit == SP_ANGLES) {
+    rc = _robot->commandNB(LBCMD_MOVETO, _angles[0], _angles[1], _angles[2]);
+  } else if(bit == SP_POWERS) {
+    rc = _robot->commandNB(LBCMD_SETMOTORPOWER, 0x07, _powers[0], _powers[1], _powers[2]);
+  } else {
+    i = (bit == SP_SPEED1) ? 0 : (bit == SP_SPEED2) ? 1 : 2;
+    rc = _robot->commandNB(LBCMD_SETJOINTSPEED, i + 1, _speeds[i]);
+    _inflightSpeed = _speeds[i];
+  }
+  _inflight = bit;
+  if(rc) {
+    /* Keep the setpoint for the next try */
+    _stats.errors++;
+    _pending |= bit;
+    _inflight = 0;
+  } else {
+    _stats.sent++;
+  }
+  return pending();
+}
+
+int LinkbotSetpointStream::flush()
+{
+  unsigned long errors = _stats.errors;
+  while(update() > 0) {
+    if(_stats.errors != errors) {
+      return -1;
+    }
+    LinkbotScheduler::yield();
+  }
+  return (_stats.errors != errors) ? -1 : 0;
+}
+
+void LinkbotSetpointStream::getStats(linkbotStreamStats_t &stats)
+{
+  stats = _stats;
+}
+
+void LinkbotSetpointStream::resetStats()
+{
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+/* The number of setpoints not yet acknowledged */
+int LinkbotSetpointStream::pending()
+{
+  int n = _inflight ? 1 : 0;
+  uint8_t bits;
+  for(bits = _pending; bits; bits &= bits - 1) {
+    n++;
+  }
+  return n;
+}
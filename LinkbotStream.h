@@ -0,0 +1,84 @@
+#ifndef _LINKBOT_STREAM_H_
+#define _LINKBOT_STREAM_H_
+
+#include "Linkbot.h"
+
+/** Counts kept by a LinkbotSetpointStream. */
+typedef struct linkbotStreamStats_s
+{
+  unsigned long sent;       /* setpoints sent to the robot */
+  unsigned long conflated;  /* setpoints replaced before they were sent */
+  unsigned long errors;     /* setpoints which failed to send or weren't acknowledged */
+} linkbotStreamStats_t;
+
+/**
+ * The LinkbotSetpointStream Class.
+ * Streams setpoints to one robot without letting them queue up, for
+ * teleoperation, for example::
+
+      LinkbotSetpointStream stream(robot);
+
+      void loop() {
+        int x = analogRead(A0) - 512;
+        int y = analogRead(A1) - 512;
+        stream.setMotorPowers(y + x, 0, -(y - x));
+      }
+
+  Each kind of setpoint (joint goals, joint speeds, motor powers) has a
+  single pending value which the setters overwrite. At most one command is
+  in flight to the robot; when it is acknowledged, the latest pending value
+  goes out next. A setpoint which has been overwritten is never sent, so
+  the robot is at most one round trip behind the sketch however fast it
+  produces setpoints. The setters never block.
+
+  While the stream is in use, the robot should not be sent other commands:
+  a blocking command abandons the stream's command in flight.
+ */
+class LinkbotSetpointStream {
+  public:
+    LinkbotSetpointStream(Linkbot &robot);
+
+    /** Set the joints' goals, as Linkbot::moveToNB(). */
+    void moveTo(float angle1, float angle2, float angle3);
+
+    /**
+     * Set the joints' speeds, as Linkbot::setJointSpeeds(). Only joints
+     * whose speed changed are sent.
+     */
+    void setJointSpeeds(float speed1, float speed2, float speed3);
+
+    /** Set the motors' powers, as Linkbot::setMotorPowers(). */
+    void setMotorPowers(int power1, int power2, int power3);
+
+    /**
+     * Collect the acknowledgement of the command in flight and send the
+     * next pending setpoint. Called by the setters; call it from loop() as
+     * well so setpoints go out while the sketch has none to give. Returns
+     * the number of setpoints not yet acknowledged.
+     */
+    int update();
+
+    /** Wait until every pending setpoint has been sent and acknowledged. */
+    int flush();
+
+    /** Get the counts since the stream was made or resetStats(). */
+    void getStats(linkbotStreamStats_t &stats);
+
+    /** Clear the counts. */
+    void resetStats();
+
+  private:
+    int pending();
+    Linkbot *_robot;
+    float _angles[3];
+    float _speeds[3];
+    float _sentSpeeds[3];
+    int _powers[3];
+    float _inflightSpeed;
+    uint8_t _pending;
+    uint8_t _inflight;
+    uint8_t _next;
+    linkbotStreamStats_t _stats;
+};
+
+#endif
@@ -0,0 +1,236 @@
+
+#include <Arduino.h>
+#include <math.h>
+
+#include "LinkbotWatcher.h"
+#include "LinkbotScheduler.h"
+
+/* How often to sample a watcher whose value has not been seen to change,
+ * and the bounds on the interval once it has, in milliseconds */
+#define WATCH_INTERVAL 100
+#define WATCH_INTERVAL_MIN 20
+#define WATCH_INTERVAL_MAX 1000
+
+#define WATCH_USED    0x01
+#define WATCH_ARMED   0x02
+#define WATCH_SEEN    0x04  /* last holds a sample */
+#define WATCH_SAMPLED 0x08  /* sampled in the current pass */
+
+/* The reads channels are taken from */
+#define SOURCE_ANGLES  0
+#define SOURCE_ACCEL   1
+#define SOURCE_BATTERY 2
+
+typedef struct watcherEntry_s {
+  Linkbot *robot;
+  linkbotWatchFunc_t func;
+  void *context;
+  linkbotWatch_t watch;
+  float last;
+  unsigned long lastAt;
+  unsigned long next;
+  uint8_t flags;
+} watcherEntry_t;
+
+static watcherEntry_t g_watchers[LINKBOT_MAX_WATCHERS];
+static int g_samplerTask = -1;
+
+static uint8_t watchSource(uint8_t channel)
+{
+  if(channel <= LB_WATCH_JOINT3) {
+    return SOURCE_ANGLES;
+  }
+  if(channel == LB_WATCH_BATTERY) {
+    return SOURCE_BATTERY;
+  }
+  return SOURCE_ACCEL;
+}
+
+/* Read a source. The source's channels of values, which is indexed by
+ * channel, are filled in. */
+static int readSource(Linkbot *robot, uint8_t source, float values[])
+{
+  float *accel = &values[LB_WATCH_ACCEL_X];
+  float magnitude;
+  switch(source) {
+    case SOURCE_ANGLES:
+      return robot->getJointAngles(values[LB_WATCH_JOINT1],
+          values[LB_WATCH_JOINT2], values[LB_WATCH_JOINT3]);
+    case SOURCE_ACCEL:
+      if(robot->getAccelerometerData(accel[0], accel[1], accel[2])) {
+        return -1;
+      }
+      magnitude = sqrt(accel[0]*accel[0] + accel[1]*accel[1] + accel[2]*accel[2]);
+      values[LB_WATCH_TILT] = (magnitude > 0) ?
+        acos(accel[2] / magnitude) * 180.0 / M_PI : 0;
+      return 0;
+    case SOURCE_BATTERY:
+      return robot->getBatteryVoltage(values[LB_WATCH_BATTERY]);
+  }
+  return -1;
+}
+
+/* Check a watcher against a fresh sample, fire it if it trips, and schedule
+ * its next sample */
+static void watchSample(int id, float value, unsigned long now)
+{
+  watcherEntry_t *entry = &g_watchers[id];
+  linkbotWatch_t *watch = &entry->watch;
+  float distance;
+  float rate;
+  unsigned long interval = WATCH_INTERVAL;
+  int above = (watch->comparator == LB_WATCH_ABOVE);
+  if(entry->flags & WATCH_ARMED) {
+    if(above ? (value > watch->threshold) : (value < watch->threshold)) {
+      entry->flags &= ~WATCH_ARMED;
+      if(watch->flags & LB_WATCH_ONCE) {
+        entry->flags = 0;
+      }
+      entry->func(id, value, entry->context);
+      if(!(entry->flags & WATCH_USED)) {
+        return;
+      }
+    }
+  } else if(above ? (value < watch->threshold - watch->hysteresis) :
+                    (value > watch->threshold + watch->hysteresis)) {
+    entry->flags |= WATCH_ARMED;
+  }
+  /* How far the value has to go before the watcher changes state */
+  if(entry->flags & WATCH_ARMED) {
+    distance = fabs(value - watch->threshold);
+  } else {
+    distance = fabs(value - (above ? watch->threshold - watch->hysteresis :
+                                     watch->threshold + watch->hysteresis));
+  }
+  if((entry->flags & WATCH_SEEN) && now != entry->lastAt) {
+    rate = fabs(value - entry->last) / (now - entry->lastAt);
+    if(rate > 0) {
+      /* Look again well before the value could get there */
+      interval = (unsigned long)(0.5 * distance / rate);
+    } else {
+      interval = WATCH_INTERVAL_MAX;
+    }
+    if(interval < WATCH_INTERVAL_MIN) {
+      interval = WATCH_INTERVAL_MIN;
+    } else if(interval > WATCH_INTERVAL_MAX) {
+      interval = WATCH_INTERVAL_MAX;
+    }
+  }
+  entry->last = value;
+  entry->lastAt = now;
+  entry->next = now + interval;
+  entry->flags |= WATCH_SEEN | WATCH_SAMPLED;
+}
+
+static char samplerTask(linkbotTask_t *task, void *context)
+{
+  static unsigned long wait;
+  LB_TASK_BEGIN(task);
+  while(LinkbotWatcher::count() > 0) {
+    wait = LinkbotWatcher::service();
+    if(wait > 0) {
+      LB_TASK_SLEEP(task, wait);
+    } else {
+      LB_TASK_YIELD(task);
+    }
+  }
+  g_samplerTask = -1;
+  LB_TASK_END(task);
+}
+
+int LinkbotWatcher::add(Linkbot &robot, const linkbotWatch_t &watch,
+    linkbotWatchFunc_t func, void *context)
+{
+  int i;
+  if(watch.channel > LB_WATCH_BATTERY || func == NULL) {
+    return -1;
+  }
+  if(g_samplerTask < 0) {
+    g_samplerTask = LinkbotScheduler::add(samplerTask, NULL);
+    if(g_samplerTask < 0) {
+      return -1;
+    }
+  }
+  for(i = 0; i < LINKBOT_MAX_WATCHERS; i++) {
+    if(g_watchers[i].flags == 0) {
+      g_watchers[i].robot = &robot;
+      g_watchers[i].func = func;
+      g_watchers[i].context = context;
+      g_watchers[i].watch = watch;
+      g_watchers[i].next = millis();
+      g_watchers[i].flags = WATCH_USED | WATCH_ARMED;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int LinkbotWatcher::remove(int id)
+{
+  if(id < 0 || id >= LINKBOT_MAX_WATCHERS || !(g_watchers[id].flags & WATCH_USED)) {
+    return -1;
+  }
+  g_watchers[id].flags = 0;
+  return 0;
+}
+
+int LinkbotWatcher::count()
+{
+  int i;
+  int n = 0;
+  for(i = 0; i < LINKBOT_MAX_WATCHERS; i++) {
+    if(g_watchers[i].flags & WATCH_USED) {
+      n++;
+    }
+  }
+  return n;
+}
+
+unsigned long LinkbotWatcher::service()
+{
+  watcherEntry_t *entry;
+  float values[LB_WATCH_BATTERY + 1];
+  unsigned long now;
+  unsigned long wait = WATCH_INTERVAL_MAX;
+  uint8_t source;
+  int i, j;
+  for(i = 0; i < LINKBOT_MAX_WATCHERS; i++) {
+    g_watchers[i].flags &= ~WATCH_SAMPLED;
+  }
+  for(i = 0; i < LINKBOT_MAX_WATCHERS; i++) {
+    entry = &g_watchers[i];
+    if(!(entry->flags & WATCH_USED) || (entry->flags & WATCH_SAMPLED) ||
+       (long)(millis() - entry->next) < 0) {
+      continue;
+    }
+    /* One read serves every watcher on the same robot and source */
+    source = watchSource(entry->watch.channel);
+    if(readSource(entry->robot, source, values)) {
+      entry->next = millis() + WATCH_INTERVAL;
+      entry->flags |= WATCH_SAMPLED;
+      continue;
+    }
+    now = millis();
+    for(j = i; j < LINKBOT_MAX_WATCHERS; j++) {
+      if((g_watchers[j].flags & WATCH_USED) &&
+         !(g_watchers[j].flags & WATCH_SAMPLED) &&
+         g_watchers[j].robot == entry->robot &&
+         watchSource(g_watchers[j].watch.channel) == source) {
+        watchSample(j, values[g_watchers[j].watch.channel], now);
+      }
+    }
+  }
+  now = millis();
+  for(i = 0; i < LINKBOT_MAX_WATCHERS; i++) {
+    if(!(g_watchers[i].flags & WATCH_USED)) {
+      continue;
+    }
+    if((long)(g_watchers[i].next - now) <= 0) {
+      return 0;
+    }
+    if(g_watchers[i].next - now < wait) {
+      wait = g_watchers[i].next - now;
+    }
+  }
+  return wait;
+}
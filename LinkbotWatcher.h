@@ -0,0 +1,94 @@
+#ifndef _LINKBOT_WATCHER_H_
+#define _LINKBOT_WATCHER_H_
+
+#include "Linkbot.h"
+
+/* The most watchers which may be added at once */
+#ifndef LINKBOT_MAX_WATCHERS
+#define LINKBOT_MAX_WATCHERS 8
+#endif
+
+/* What a watcher watches */
+#define LB_WATCH_JOINT1  0  /* joint angles, in degrees */
+#define LB_WATCH_JOINT2  1
+#define LB_WATCH_JOINT3  2
+#define LB_WATCH_ACCEL_X 3  /* accelerometer axes, in g */
+#define LB_WATCH_ACCEL_Y 4
+#define LB_WATCH_ACCEL_Z 5
+#define LB_WATCH_TILT    6  /* angle between the robot's z axis and gravity, in degrees */
+#define LB_WATCH_BATTERY 7  /* battery voltage, in volts */
+
+/* How a watcher compares its channel with its threshold */
+#define LB_WATCH_ABOVE 0
+#define LB_WATCH_BELOW 1
+
+/* Watcher flags */
+#define LB_WATCH_ONCE 0x01  /* remove the watcher after it fires */
+
+/**
+ * A condition on one of a robot's sensors. The condition trips when the
+ * channel's value crosses threshold in the direction of comparator, and can
+ * trip again only once the value has come back past threshold by hysteresis.
+ * A condition which already holds when the watcher is added trips on the
+ * first sample. */
+typedef struct linkbotWatch_s
+{
+  uint8_t channel;
+  uint8_t comparator;
+  uint8_t flags;
+  float threshold;
+  float hysteresis;
+} linkbotWatch_t;
+
+typedef void (*linkbotWatchFunc_t)(int id, float value, void *context);
+
+/**
+ * The LinkbotWatcher Class.
+ * Calls a function when a robot's sensor reading crosses a threshold, for
+ * example::
+
+      void tipped(int id, float value, void *context)
+      {
+        Linkbot *robot = (Linkbot*)context;
+        robot->stop();
+      }
+
+      void setup() {
+        linkbotWatch_t watch = { LB_WATCH_TILT, LB_WATCH_ABOVE, 0, 45, 5 };
+        LinkbotWatcher::add(robot, watch, tipped, &robot);
+      }
+
+      void loop() {
+        LinkbotScheduler::runOnce();
+      }
+
+  All watchers are sampled by one LinkbotScheduler task, which is started
+  by the first add(). Watchers on the same robot share reads: the three
+  joint angles come from one read, as do the accelerometer axes. Each
+  watcher is sampled more often as its value nears the threshold, judging
+  by how quickly it has been changing, and less often when it is far away.
+  Callbacks run in the sampler task.
+ */
+class LinkbotWatcher {
+  public:
+    /**
+     * Start watching a condition on a robot. Returns the watcher's id, or
+     * -1 if the table is full or the sampler task can't be started.
+     */
+    static int add(Linkbot &robot, const linkbotWatch_t &watch,
+        linkbotWatchFunc_t func, void *context);
+
+    /** Stop watching. */
+    static int remove(int id);
+
+    /** Get the number of watchers in the table. */
+    static int count();
+
+    /**
+     * Sample every watcher which is due. Called by the sampler task.
+     * Returns how long until the next watcher is due, in milliseconds.
+     */
+    static unsigned long service();
+};
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Compares the two response modes, LINKBOT_RESPONSE_SLAVE and
+ * LINKBOT_RESPONSE_POLL, on the local robot. Each mode runs the same number
+ * of joint angle reads, and the round-trip times, bus bytes and arbitration
+ * counters of each are printed to the serial port.
+ *
+ * To measure arbitration on a shared bus, run the sketch on two Arduinos
+ * wired to the same robot bus, giving the second one different addresses
+ * with Linkbot::setBusAddresses().
+ *
+ * Set READY_PIN to the pin the breakout board pulls low while it holds a
+ * response, or leave it at -1 to poll on a timer.
+ */
+
+#include <Linkbot.h>
+
+#define TRANSACTIONS 200
+#define READY_PIN -1
+
+Linkbot robot;
+
+void runMode(linkbotResponseMode_t mode, const char *name)
+{
+  linkbotLinkStats_t stats;
+  unsigned long startMicros;
+  unsigned long elapsed;
+  float angle1, angle2, angle3;
+  int i;
+
+  Linkbot::setResponseMode(mode, READY_PIN);
+  Linkbot::resetLinkStats();
+  startMicros = micros();
+  for(i = 0; i < TRANSACTIONS; i++) {
+    robot.getJointAngles(angle1, angle2, angle3);
+  }
+  elapsed = micros() - startMicros;
+  Linkbot::getLinkStats(stats);
+
+  Serial.print(name);
+  Serial.println(":");
+  Serial.print("  transactions: ");
+  Serial.print(stats.transactions);
+  Serial.print(", timeouts: ");
+  Serial.println(stats.timeouts);
+  if(stats.transactions > 0) {
+    Serial.print("  rtt mean/max (us): ");
+    Serial.print(stats.rttTotal / stats.transactions);
+    Serial.print(" / ");
+    Serial.println(stats.rttMax);
+    Serial.print("  bus bytes per transaction: ");
+    Serial.println(stats.busBytes / stats.transactions);
+  }
+  Serial.print("  polls: ");
+  Serial.println(stats.polls);
+  Serial.print("  arbitrations lost/retried/dropped: ");
+  Serial.print(stats.arbLost);
+  Serial.print(" / ");
+  Serial.print(stats.arbRetries);
+  Serial.print(" / ");
+  Serial.println(stats.arbDropped);
+  Serial.print("  total time (ms): ");
+  Serial.println(elapsed / 1000);
+}
+
+void setup() {
+  Serial.begin(9600);
+}
+
+void loop() {
+  runMode(LINKBOT_RESPONSE_SLAVE, "slave");
+  runMode(LINKBOT_RESPONSE_POLL, "poll");
+  Serial.println();
+  delay(5000);
+}
@@ -0,0 +1,112 @@
+/*
+  command_sizes.cpp - Checks that the response size the command table in
+  Linkbot.cpp expects for each command is the size utility/commands.h
+  documents for it. matchSlot() turns away responses shorter than expected,
+  so a table entry larger than the firmware's response makes the command
+  time out every time.
+*/
+
+#include <stdio.h>
+#include <ctype.h>
+#include "simbus.h"
+
+// the table and responseSize() are private to Linkbot.cpp
+#include "../Linkbot.cpp"
+
+// the library's TWI node; the bus is never run
+SimTwi sim_twi;
+
+#define LINE_LENGTH 256
+
+/* Reads the size byte of the expected response from every command's doc
+   comment in the protocol_commands_e enum. Sizes which are not documented,
+   or not a number, are left 0. */
+static int readDocumentedSizes(const char *path, uint8_t sizes[], int max)
+{
+  char line[LINE_LENGTH];
+  char comment[1024] = "";
+  uint8_t inEnum = 0;
+  uint8_t inComment = 0;
+  int index = 0;
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    perror(path);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), file)) {
+    char *p = line;
+    if(!inEnum) {
+      inEnum = (strstr(line, "enum protocol_commands_e") != NULL);
+      continue;
+    }
+    if(strstr(line, "};")) {
+      break;
+    }
+    while(isspace((unsigned char)*p)) {
+      p++;
+    }
+    if(inComment || strncmp(p, "/*", 2) == 0) {
+      inComment = (strstr(p, "*/") == NULL);
+      strncat(comment, p, sizeof(comment) - strlen(comment) - 1);
+      continue;
+    }
+    if(!isalpha((unsigned char)*p) || index >= max) {
+      continue;
+    }
+    /* An enumerator; its doc comment is the one just read */
+    char *resp = strstr(comment, "Expected Response");
+    if(resp == NULL) {
+      resp = strstr(comment, "Expected response");
+    }
+    sizes[index] = 0;
+    if(resp != NULL && (resp = strstr(resp, "[0x10]")) != NULL) {
+      char *end;
+      long size;
+      resp += strlen("[0x10]");
+      while(isspace((unsigned char)*resp)) {
+        resp++;
+      }
+      size = strtol(resp + 1, &end, 0);
+      if(*resp == '[' && *end == ']') {
+        sizes[index] = size;
+      }
+    }
+    index++;
+    comment[0] = '\0';
+  }
+  fclose(file);
+  return index;
+}
+
+int main(void)
+{
+  uint8_t sizes[256];
+  commandDesc_t desc;
+  int numDocumented;
+  int checked = 0;
+  int failures = 0;
+  int id;
+
+  numDocumented = readDocumentedSizes(COMMANDS_H, sizes, sizeof(sizes));
+  if(numDocumented <= 0) {
+    printf("no commands found in %s\n", COMMANDS_H);
+    return 1;
+  }
+  for(id = 0; id < LBCMD_NUMCOMMANDS; id++) {
+    int cmd;
+    memcpy_P(&desc, &g_commands[id], sizeof(desc));
+    cmd = desc.cmd - CMD_START;
+    if((desc.flags & CF_NORESPONSE) || desc.cmd < CMD_START ||
+       cmd >= numDocumented || sizes[cmd] == 0) {
+      continue;
+    }
+    checked++;
+    if(responseSize(&desc) != sizes[cmd]) {
+      printf("command %d (0x%02X): table expects %d bytes, commands.h documents %d\n",
+             id, desc.cmd, responseSize(&desc), sizes[cmd]);
+      failures++;
+    }
+  }
+  printf("command sizes: %d checked, %s\n", checked, failures ? "FAILED" : "ok");
+  return (failures || checked == 0) ? 1 : 0;
+}
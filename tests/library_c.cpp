@@ -0,0 +1,22 @@
+/*
+  library_c.cpp - Builds the library's C sources for the host tests. They
+  are compiled as C++ so they can use the simulated TWI registers, with C
+  linkage as the library expects.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <compat/twi.h>
+#include "Arduino.h"
+#include "pins_arduino.h"
+
+extern "C" {
+#include "../utility/framepool.c"
+#include "../utility/framing.c"
+#include "../utility/twi.c"
+}
@@ -0,0 +1,54 @@
+/*
+  node.h - Test glue for one node of the simulated bus. Included into the
+  node's namespace after its copies of framepool.c and twi.c, so every name
+  below is the node's own.
+*/
+
+nodeLog_t log;
+
+static void onReceive(uint8_t* data, int length)
+{
+  if(NODE_LOG_FRAMES > log.numReceived){
+    memcpy(log.received[log.numReceived], data, length);
+    log.receivedLength[log.numReceived++] = length;
+  }
+}
+
+static void onTransmit(void)
+{
+  twi_transmit(log.reply, log.replyLength);
+}
+
+static void onDone(uint8_t error, uint8_t* data, uint8_t length, void* context)
+{
+  if(NODE_LOG_FRAMES > log.numDone){
+    memcpy(log.done[log.numDone], data, length);
+    log.doneLength[log.numDone] = length;
+    log.errors[log.numDone++] = error;
+  }
+}
+
+static void begin(uint8_t address)
+{
+  memset(&log, 0, sizeof(log));
+  twi_init();
+  twi_setAddress(address);
+  twi_attachSlaveRxEvent(onReceive);
+  twi_attachSlaveTxEvent(onTransmit);
+  twi_resetStats();
+}
+
+static uint8_t writeTo(uint8_t address, const uint8_t* data, uint8_t length)
+{
+  return twi_writeToAsync(address, data, length, true, onDone, 0);
+}
+
+static uint8_t readFrom(uint8_t address, uint8_t length)
+{
+  return twi_readFromAsync(address, length, true, onDone, 0);
+}
+
+node_t node = {
+  &sim_twi, &log, TWI_vect, begin, writeTo, readFrom,
+  twi_setAddress, twi_service, twi_pending, twi_getStats, framepool_inUse
+};
@@ -0,0 +1,8 @@
+/*
+  nodeapi.h - Included into each node's namespace before its copy of twi.c.
+  twi.h has already been read outside the namespaces, so functions twi.c
+  calls before defining them are declared again here, or the calls would
+  bind to the global declarations instead of the node's own copies.
+*/
+
+uint8_t twi_writeToAsync(uint8_t, const uint8_t*, uint8_t, uint8_t, twi_callback_t, void*);
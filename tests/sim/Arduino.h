@@ -0,0 +1,27 @@
+/* the parts of the Arduino core the library uses */
+#ifndef sim_Arduino_h
+#define sim_Arduino_h
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#define LOW  0
+#define HIGH 1
+
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+#endif
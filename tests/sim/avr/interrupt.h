@@ -0,0 +1,9 @@
+/* the simulation runs interrupts only between bus steps */
+#ifndef sim_avr_interrupt_h
+#define sim_avr_interrupt_h
+
+#define cli()
+#define sei()
+#define SIGNAL(vector) void vector(void)
+
+#endif
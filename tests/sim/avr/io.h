@@ -0,0 +1,34 @@
+/* TWI registers of the simulated node being compiled; see simbus.h */
+#ifndef sim_avr_io_h
+#define sim_avr_io_h
+
+#include <inttypes.h>
+#include "simbus.h"
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+// the node being compiled; a node in a namespace of its own hides this one
+extern SimTwi sim_twi;
+
+#define TWCR (sim_twi.twcr)
+#define TWDR (sim_twi.twdr)
+#define TWSR (sim_twi.twsr)
+#define TWAR (sim_twi.twar)
+#define TWBR (sim_twi.twbr)
+
+#define TWINT 7
+#define TWEA  6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC  3
+#define TWEN  2
+#define TWIE  0
+
+#define TWPS1 1
+#define TWPS0 0
+
+extern uint8_t sim_sreg;
+#define SREG sim_sreg
+
+#endif
@@ -0,0 +1,13 @@
+/* program memory is ordinary memory on the host */
+#ifndef sim_avr_pgmspace_h
+#define sim_avr_pgmspace_h
+
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define memcpy_P(dest, src, n) memcpy((dest), (src), (n))
+
+#endif
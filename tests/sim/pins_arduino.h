@@ -0,0 +1,7 @@
+#ifndef sim_pins_arduino_h
+#define sim_pins_arduino_h
+
+#define SDA 18
+#define SCL 19
+
+#endif
@@ -0,0 +1,260 @@
+/*
+  simbus.cpp - A simulated multi-master TWI bus, for testing utility/twi.c on
+  a Linux host. See simbus.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <compat/twi.h>
+#include "simbus.h"
+
+#define ROLE_NONE   0
+#define ROLE_MASTER 1
+#define ROLE_SLAVE  2
+
+#define PHASE_IDLE    0
+#define PHASE_ADDRESS 1
+#define PHASE_NACKED  2
+#define PHASE_WRITE   3
+#define PHASE_READ    4
+
+unsigned long sim_millis;
+
+static SimTwi *g_nodes[SIMBUS_MAX_NODES];
+static uint8_t g_numNodes;
+static SimTwi *g_masters[SIMBUS_MAX_NODES];
+static uint8_t g_numMasters;
+static SimTwi *g_slave;
+static uint8_t g_phase;
+
+SimTwi::SimTwi()
+{
+  twcr.node = this;
+  twcr.value = 0;
+  twdr = 0;
+  twsr = 0;
+  twar = 0;
+  twbr = 0;
+  interrupt = 0;
+  released = 0;
+  start = 0;
+  stop = 0;
+  role = ROLE_NONE;
+  isr = 0;
+}
+
+SimTwcr &SimTwcr::operator=(int v)
+{
+  // TWSTO clears itself once the stop is on the bus, which in the
+  // simulation is at once; TWINT is cleared by writing it
+  value = v & ~(_BV(TWINT) | _BV(TWSTO));
+  if(v & _BV(TWINT)){
+    node->interrupt = 0;
+    node->released = 1;
+    if(v & _BV(TWSTA)){
+      node->start = 1;
+    }
+    // a slave writing TWSTO only resets its own interface
+    if((v & _BV(TWSTO)) && ROLE_MASTER == node->role){
+      node->stop = 1;
+    }
+  }else if(0 == (v & _BV(TWSTA))){
+    node->start = 0;
+  }
+  return *this;
+}
+
+SimTwcr::operator uint8_t() const
+{
+  return value | (node->interrupt ? _BV(TWINT) : 0);
+}
+
+void simbus_attach(SimTwi *node, void (*isr)(void))
+{
+  if(SIMBUS_MAX_NODES <= g_numNodes){
+    fprintf(stderr, "simbus: too many nodes\n");
+    abort();
+  }
+  node->isr = isr;
+  g_nodes[g_numNodes++] = node;
+}
+
+uint8_t simbus_idle(void)
+{
+  return PHASE_IDLE == g_phase;
+}
+
+static void raise(SimTwi *node, uint8_t status)
+{
+  node->twsr = (node->twsr & ~TW_STATUS_MASK) | status;
+  node->interrupt = 1;
+  node->released = 0;
+}
+
+static uint8_t mastersReleased(void)
+{
+  uint8_t i;
+  for(i = 0; i < g_numMasters; i++){
+    if(!g_masters[i]->released){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* every master sends its TWDR; those sending less than the lowest byte
+   lose and are told so unless lost() says otherwise */
+static uint8_t arbitrate(void)
+{
+  uint8_t i, n;
+  uint8_t lowest = 0xFF;
+  for(i = 0; i < g_numMasters; i++){
+    if(g_masters[i]->twdr < lowest){
+      lowest = g_masters[i]->twdr;
+    }
+  }
+  for(i = 0, n = 0; i < g_numMasters; i++){
+    if(g_masters[i]->twdr == lowest){
+      g_masters[n++] = g_masters[i];
+    }else if(PHASE_ADDRESS == g_phase &&
+             (g_masters[i]->twar >> 1) == (lowest >> 1) &&
+             (g_masters[i]->twcr.value & _BV(TWEA))){
+      // lost to the master addressing it
+      g_masters[i]->role = ROLE_SLAVE;
+      g_slave = g_masters[i];
+      raise(g_slave, (lowest & TW_READ) ? TW_ST_ARB_LOST_SLA_ACK : TW_SR_ARB_LOST_SLA_ACK);
+    }else{
+      g_masters[i]->role = ROLE_NONE;
+      raise(g_masters[i], TW_MT_ARB_LOST);
+    }
+  }
+  g_numMasters = n;
+  return lowest;
+}
+
+static void startTransfers(void)
+{
+  uint8_t i;
+  g_numMasters = 0;
+  for(i = 0; i < g_numNodes; i++){
+    if(g_nodes[i]->start){
+      g_nodes[i]->start = 0;
+      g_nodes[i]->role = ROLE_MASTER;
+      g_masters[g_numMasters++] = g_nodes[i];
+      raise(g_nodes[i], TW_START);
+    }
+  }
+  if(g_numMasters){
+    g_slave = 0;
+    g_phase = PHASE_ADDRESS;
+  }
+}
+
+static void sendAddress(void)
+{
+  uint8_t i;
+  uint8_t sla = arbitrate();
+  uint8_t read = sla & TW_READ;
+
+  if(0 == g_slave){
+    for(i = 0; i < g_numNodes; i++){
+      if(ROLE_NONE == g_nodes[i]->role &&
+         (g_nodes[i]->twar >> 1) == (sla >> 1) &&
+         (g_nodes[i]->twcr.value & _BV(TWEA))){
+        g_slave = g_nodes[i];
+        g_slave->role = ROLE_SLAVE;
+        raise(g_slave, read ? TW_ST_SLA_ACK : TW_SR_SLA_ACK);
+        break;
+      }
+    }
+  }
+  for(i = 0; i < g_numMasters; i++){
+    if(g_slave){
+      raise(g_masters[i], read ? TW_MR_SLA_ACK : TW_MT_SLA_ACK);
+    }else{
+      raise(g_masters[i], read ? TW_MR_SLA_NACK : TW_MT_SLA_NACK);
+    }
+  }
+  g_phase = g_slave ? (read ? PHASE_READ : PHASE_WRITE) : PHASE_NACKED;
+}
+
+static void stopTransfer(void)
+{
+  uint8_t i;
+  for(i = 0; i < g_numMasters; i++){
+    g_masters[i]->stop = 0;
+    g_masters[i]->role = ROLE_NONE;
+  }
+  if(g_slave){
+    if(PHASE_WRITE == g_phase){
+      raise(g_slave, TW_SR_STOP);
+    }
+    g_slave->role = ROLE_NONE;
+  }
+  g_numMasters = 0;
+  g_slave = 0;
+  g_phase = PHASE_IDLE;
+}
+
+static void sendData(void)
+{
+  uint8_t i;
+  uint8_t data;
+  uint8_t ack;
+
+  if(PHASE_WRITE == g_phase){
+    data = arbitrate();
+    ack = g_slave->twcr.value & _BV(TWEA);
+    g_slave->twdr = data;
+    raise(g_slave, ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK);
+    for(i = 0; i < g_numMasters; i++){
+      raise(g_masters[i], ack ? TW_MT_DATA_ACK : TW_MT_DATA_NACK);
+    }
+  }else{
+    data = g_slave->twdr;
+    // the masters read together, so they ack together
+    ack = g_masters[0]->twcr.value & _BV(TWEA);
+    for(i = 0; i < g_numMasters; i++){
+      g_masters[i]->twdr = data;
+      raise(g_masters[i], ack ? TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+    }
+    if(!ack){
+      raise(g_slave, TW_ST_DATA_NACK);
+    }else if(g_slave->twcr.value & _BV(TWEA)){
+      raise(g_slave, TW_ST_DATA_ACK);
+    }else{
+      raise(g_slave, TW_ST_LAST_DATA);
+    }
+  }
+}
+
+void simbus_step(void)
+{
+  uint8_t i;
+
+  for(i = 0; i < g_numNodes; i++){
+    if(g_nodes[i]->interrupt && (g_nodes[i]->twcr.value & _BV(TWIE))){
+      g_nodes[i]->isr();
+    }
+  }
+
+  if(PHASE_IDLE == g_phase){
+    startTransfers();
+    return;
+  }
+  // the masters and the slave hold the clock until their interrupts are done
+  if(!mastersReleased() || (g_slave && !g_slave->released)){
+    return;
+  }
+  if(0 == g_numMasters || g_masters[0]->stop){
+    stopTransfer();
+  }else if(g_masters[0]->start){
+    fprintf(stderr, "simbus: repeated start not simulated\n");
+    abort();
+  }else if(PHASE_ADDRESS == g_phase){
+    sendAddress();
+  }else if(PHASE_READ == g_phase || PHASE_WRITE == g_phase){
+    sendData();
+  }
+}
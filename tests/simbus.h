@@ -0,0 +1,61 @@
+/*
+  simbus.h - A simulated multi-master TWI bus, for testing utility/twi.c on
+  a Linux host.
+
+  Every node on the bus is its own copy of twi.c and framepool.c, compiled
+  into a namespace which also holds the node's TWI registers (a SimTwi
+  named sim_twi; see sim/avr/io.h). simbus_step() plays the part of the TWI
+  hardware of all the nodes: it runs the interrupt of every node which has
+  one pending, then moves the bus on by one event - a start, an address or
+  data byte, or a stop - and raises the interrupts that event causes.
+
+  Time is not modelled below one byte. Masters which ask for a start while
+  the bus is idle in the same step all get it, and are then arbitrated byte
+  by byte the way the wire arbitrates them bit by bit: the lowest byte
+  wins. Repeated starts are not simulated.
+*/
+
+#ifndef simbus_h
+#define simbus_h
+
+  #include <inttypes.h>
+
+  #define SIMBUS_MAX_NODES 8
+
+  struct SimTwi;
+
+  // TWCR, which starts bus events when TWINT is written
+  struct SimTwcr {
+    SimTwi *node;
+    uint8_t value;
+
+    SimTwcr &operator=(int value);
+    operator uint8_t() const;
+  };
+
+  // the TWI registers and hardware state of one node
+  struct SimTwi {
+    SimTwcr twcr;
+    uint8_t twdr;
+    uint8_t twsr;
+    uint8_t twar;
+    uint8_t twbr;
+
+    uint8_t interrupt;  // TWINT raised by the hardware
+    uint8_t released;   // TWINT cleared by software since it was raised
+    uint8_t start;      // start condition asked for
+    uint8_t stop;       // stop condition asked for
+    uint8_t role;
+    void (*isr)(void);
+
+    SimTwi();
+  };
+
+  // milliseconds since the simulation began; millis() returns it
+  extern unsigned long sim_millis;
+
+  void simbus_attach(SimTwi *node, void (*isr)(void));
+  void simbus_step(void);
+  uint8_t simbus_idle(void);
+
+#endif
@@ -0,0 +1,299 @@
+/*
+  twi_multimaster.cpp - Runs several masters against each other on the
+  simulated bus and checks that utility/twi.c detects lost arbitration,
+  retries with a backoff, takes turns with other masters and answers at
+  the slave address it is given.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <compat/twi.h>
+#include "Arduino.h"
+#include "pins_arduino.h"
+#include "twi.h"
+#include "framepool.h"
+#include "simbus.h"
+
+// bus events per millisecond; a byte takes about 90us at 100kHz
+#define STEPS_PER_MS 11
+
+#define NODE_LOG_FRAMES 16
+
+// what a node saw, filled in from its TWI interrupt
+typedef struct {
+  uint8_t received[NODE_LOG_FRAMES][TWI_BUFFER_LENGTH];
+  uint8_t receivedLength[NODE_LOG_FRAMES];
+  uint8_t numReceived;
+  uint8_t done[NODE_LOG_FRAMES][TWI_BUFFER_LENGTH];
+  uint8_t doneLength[NODE_LOG_FRAMES];
+  uint8_t errors[NODE_LOG_FRAMES];
+  uint8_t numDone;
+  uint8_t reply[TWI_BUFFER_LENGTH];
+  uint8_t replyLength;
+} nodeLog_t;
+
+typedef struct {
+  SimTwi *twi;
+  nodeLog_t *log;
+  void (*isr)(void);
+  void (*begin)(uint8_t);
+  uint8_t (*writeTo)(uint8_t, const uint8_t*, uint8_t);
+  uint8_t (*readFrom)(uint8_t, uint8_t);
+  void (*setAddress)(uint8_t);
+  void (*service)(void);
+  uint8_t (*pending)(void);
+  void (*getStats)(twi_stats_t*);
+  uint8_t (*poolInUse)(void);
+} node_t;
+
+// each node is a copy of the TWI layer of its own
+namespace nodeA {
+  SimTwi sim_twi;
+  #include "../utility/framepool.c"
+  #include "nodeapi.h"
+  #include "../utility/twi.c"
+  #include "node.h"
+}
+
+namespace nodeB {
+  SimTwi sim_twi;
+  #include "../utility/framepool.c"
+  #include "nodeapi.h"
+  #include "../utility/twi.c"
+  #include "node.h"
+}
+
+namespace nodeC {
+  SimTwi sim_twi;
+  #include "../utility/framepool.c"
+  #include "nodeapi.h"
+  #include "../utility/twi.c"
+  #include "node.h"
+}
+
+#define ADDR_A 0x10
+#define ADDR_B 0x11
+#define ADDR_C 0x02
+
+static node_t *A = &nodeA::node;
+static node_t *B = &nodeB::node;
+static node_t *C = &nodeC::node;
+static node_t *g_nodes[] = { A, B, C };
+#define NUM_NODES (sizeof(g_nodes) / sizeof(g_nodes[0]))
+
+static int g_failures;
+
+// the longest the bus has sat idle, in steps, while a transfer was queued
+static unsigned long g_longestGap;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      g_failures++; \
+    } \
+  } while(0)
+
+static void beginAll(void)
+{
+  g_longestGap = 0;
+  A->begin(ADDR_A);
+  B->begin(ADDR_B);
+  C->begin(ADDR_C);
+}
+
+// runs the bus for ms milliseconds, calling every node's twi_service() as
+// its main loop would
+static void run(unsigned long ms)
+{
+  static unsigned long gap;
+  unsigned long i, j;
+  uint8_t waiting;
+  for(i = 0; i < ms; i++){
+    for(j = 0; j < STEPS_PER_MS; j++){
+      simbus_step();
+      waiting = 0;
+      for(unsigned n = 0; n < NUM_NODES; n++){
+        g_nodes[n]->service();
+        waiting |= g_nodes[n]->pending();
+      }
+      gap = (simbus_idle() && waiting) ? gap + 1 : 0;
+      if(gap > g_longestGap){
+        g_longestGap = gap;
+      }
+    }
+    sim_millis++;
+  }
+}
+
+static twi_stats_t stats(node_t *node)
+{
+  twi_stats_t s;
+  node->getStats(&s);
+  return s;
+}
+
+// every transfer finished and every pool block back
+static void checkSettled(void)
+{
+  CHECK(simbus_idle());
+  for(unsigned n = 0; n < NUM_NODES; n++){
+    CHECK(0 == g_nodes[n]->pending());
+    CHECK(0 == g_nodes[n]->poolInUse());
+  }
+}
+
+static int received(node_t *node, const uint8_t *frame, uint8_t length)
+{
+  for(int i = 0; i < node->log->numReceived; i++){
+    if(length == node->log->receivedLength[i] &&
+       0 == memcmp(frame, node->log->received[i], length)){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Two masters start writing to the same slave at once. The one sending the
+   lower data byte wins; the other sees TW_MT_ARB_LOST, backs off and sends
+   its frame afterwards. */
+static void testArbitration(void)
+{
+  static const uint8_t frameA[] = { 0x01, 0x11, 0x12, 0x13 };
+  static const uint8_t frameB[] = { 0x02, 0x21, 0x22, 0x23 };
+  twi_stats_t sa, sb;
+
+  beginAll();
+  CHECK(0 == A->writeTo(ADDR_C, frameA, sizeof(frameA)));
+  CHECK(0 == B->writeTo(ADDR_C, frameB, sizeof(frameB)));
+  run(50);
+
+  CHECK(2 == C->log->numReceived);
+  CHECK(0 == received(C, frameA, sizeof(frameA)));
+  CHECK(1 == received(C, frameB, sizeof(frameB)));
+  CHECK(1 == A->log->numDone && TWI_NO_ERROR == A->log->errors[0]);
+  CHECK(1 == B->log->numDone && TWI_NO_ERROR == B->log->errors[0]);
+  sa = stats(A);
+  sb = stats(B);
+  CHECK(1 == sa.transfers && 0 == sa.arbLost);
+  CHECK(1 == sb.transfers && 1 == sb.arbLost && 1 == sb.retries);
+  CHECK(0 == sa.dropped && 0 == sb.dropped);
+  checkSettled();
+}
+
+/* Two masters write to each other at once. The one addressing the lower
+   address wins, and the loser answers as its slave before retrying its own
+   write. */
+static void testLostToAddressingMaster(void)
+{
+  static const uint8_t frameA[] = { 0xA0, 0xA1 };
+  static const uint8_t frameB[] = { 0xB0, 0xB1, 0xB2 };
+  twi_stats_t sa, sb;
+
+  beginAll();
+  CHECK(0 == A->writeTo(ADDR_B, frameA, sizeof(frameA)));
+  CHECK(0 == B->writeTo(ADDR_A, frameB, sizeof(frameB)));
+  run(50);
+
+  CHECK(1 == A->log->numReceived && 0 == received(A, frameB, sizeof(frameB)));
+  CHECK(1 == B->log->numReceived && 0 == received(B, frameA, sizeof(frameA)));
+  CHECK(1 == A->log->numDone && TWI_NO_ERROR == A->log->errors[0]);
+  CHECK(1 == B->log->numDone && TWI_NO_ERROR == B->log->errors[0]);
+  sa = stats(A);
+  sb = stats(B);
+  CHECK(1 == sa.arbLost && 1 == sa.retries && 1 == sa.transfers);
+  CHECK(0 == sb.arbLost && 1 == sb.transfers);
+  checkSettled();
+}
+
+/* A master with a long run of transfers leaves the bus idle for a
+   millisecond after every TWI_FAIR_BURST of them, so other masters get a
+   turn. */
+static void testFairness(void)
+{
+  uint8_t frame[2] = { 0x00, 0x00 };
+  uint8_t sent = 0;
+  unsigned long ms;
+  twi_stats_t sa;
+
+  beginAll();
+  for(ms = 0; ms < 50; ms++){
+    // keep the queue full until three bursts have been sent
+    while(3 * TWI_FAIR_BURST > sent && TWI_QUEUE_LENGTH > A->pending()){
+      frame[1] = sent++;
+      CHECK(0 == A->writeTo(ADDR_C, frame, sizeof(frame)));
+    }
+    run(1);
+  }
+
+  CHECK(3 * TWI_FAIR_BURST == C->log->numReceived);
+  sa = stats(A);
+  CHECK(3 * TWI_FAIR_BURST == sa.transfers);
+  // no pause after the last burst, which empties the queue
+  CHECK(2 == sa.yields);
+  CHECK(STEPS_PER_MS <= g_longestGap);
+  checkSettled();
+}
+
+/* A slave answers only at the address it was last given. */
+static void testSlaveAddress(void)
+{
+  static const uint8_t frame[] = { 0x5A };
+  twi_stats_t sa;
+
+  beginAll();
+  C->setAddress(0x33);
+  CHECK(0 == A->writeTo(ADDR_C, frame, sizeof(frame)));
+  run(5);
+  CHECK(1 == A->log->numDone && TW_MT_SLA_NACK == A->log->errors[0]);
+  CHECK(0 == C->log->numReceived);
+
+  CHECK(0 == A->writeTo(0x33, frame, sizeof(frame)));
+  run(5);
+  CHECK(2 == A->log->numDone && TWI_NO_ERROR == A->log->errors[1]);
+  CHECK(1 == C->log->numReceived && 0 == received(C, frame, sizeof(frame)));
+  sa = stats(A);
+  CHECK(2 == sa.transfers && 0 == sa.arbLost);
+  checkSettled();
+}
+
+/* An asynchronous read gets what the slave hands twi_transmit(). */
+static void testSlaveTransmit(void)
+{
+  static const uint8_t reply[] = { 0xCA, 0xFE, 0x01 };
+
+  beginAll();
+  memcpy(C->log->reply, reply, sizeof(reply));
+  C->log->replyLength = sizeof(reply);
+  CHECK(0 == A->readFrom(ADDR_C, sizeof(reply)));
+  run(5);
+  CHECK(1 == A->log->numDone && TWI_NO_ERROR == A->log->errors[0]);
+  CHECK(sizeof(reply) == A->log->doneLength[0]);
+  CHECK(0 == memcmp(reply, A->log->done[0], sizeof(reply)));
+  checkSettled();
+}
+
+static void runTest(const char *name, void (*test)(void))
+{
+  int failures = g_failures;
+  test();
+  printf("%s: %s\n", name, (failures == g_failures) ? "ok" : "FAILED");
+}
+
+int main(void)
+{
+  for(unsigned n = 0; n < NUM_NODES; n++){
+    simbus_attach(g_nodes[n]->twi, g_nodes[n]->isr);
+  }
+  runTest("arbitration", testArbitration);
+  runTest("lost to addressing master", testLostToAddressingMaster);
+  runTest("fairness", testFairness);
+  runTest("slave address", testSlaveAddress);
+  runTest("slave transmit", testSlaveTransmit);
+  return g_failures ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+/*
+  framepool.c - Fixed-block frame buffer pool shared by the Linkbot library
+  and the TWI layer.
+
+  Frames are only alive while they are being built, sent or read, so a few
+  blocks borrowed on demand replace the per-instance and per-direction
+  buffers which used to be allocated statically. The pool may be used from
+  both the main program and the TWI interrupt.
+*/
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "framepool.h"
+
+static uint8_t framepool_blocks[FRAMEPOOL_BLOCKS][FRAMEPOOL_BLOCK_SIZE];
+static uint16_t framepool_used;		// bit n set: block n is borrowed
+static uint8_t framepool_count;
+static uint8_t framepool_max;
+
+/* 
+ * Function framepool_take
+ * Desc     takes a free block out of the pool, leaving some in reserve
+ * Input    reserve: number of free blocks which must be left
+ * Output   pointer to a FRAMEPOOL_BLOCK_SIZE byte block, or 0 if no block
+ *          beyond the reserve is free
+ */
+static uint8_t* framepool_take(uint8_t reserve)
+{
+  uint8_t i;
+  uint8_t* block = 0;
+  uint8_t sreg = SREG;
+
+  cli();
+  if(framepool_count + reserve >= FRAMEPOOL_BLOCKS){
+    SREG = sreg;
+    return 0;
+  }
+  for(i = 0; i < FRAMEPOOL_BLOCKS; ++i){
+    if(!(framepool_used & (1U << i))){
+      framepool_used |= (1U << i);
+      block = framepool_blocks[i];
+      if(++framepool_count > framepool_max){
+        framepool_max = framepool_count;
+      }
+      break;
+    }
+  }
+  SREG = sreg;
+  return block;
+}
+
+/* 
+ * Function framepool_borrow
+ * Desc     takes a free block out of the pool, other than the last one
+ * Input    none
+ * Output   pointer to a FRAMEPOOL_BLOCK_SIZE byte block, or 0 if the pool
+ *          is exhausted
+ */
+uint8_t* framepool_borrow(void)
+{
+  return framepool_take(1);
+}
+
+/* 
+ * Function framepool_borrowUrgent
+ * Desc     takes a free block out of the pool for an urgent frame, which
+ *          may be the last one. Only one urgent frame is built or queued at
+ *          a time, so one block in reserve is enough.
+ * Input    none
+ * Output   pointer to a FRAMEPOOL_BLOCK_SIZE byte block, or 0 if the pool
+ *          is exhausted
+ */
+uint8_t* framepool_borrowUrgent(void)
+{
+  return framepool_take(0);
+}
+
+/* 
+ * Function framepool_return
+ * Desc     gives a block back to the pool
+ * Input    block: pointer returned by framepool_borrow, or 0. Buffers from
+ *          outside the pool are ignored.
+ * Output   none
+ */
+void framepool_return(uint8_t* block)
+{
+  uint8_t i;
+  uint8_t sreg;
+
+  if(block < framepool_blocks[0] || block >= framepool_blocks[FRAMEPOOL_BLOCKS]){
+    return;
+  }
+  i = (block - framepool_blocks[0]) / FRAMEPOOL_BLOCK_SIZE;
+  sreg = SREG;
+  cli();
+  if(framepool_used & (1U << i)){
+    framepool_used &= ~(1U << i);
+    framepool_count--;
+  }
+  SREG = sreg;
+}
+
+/* 
+ * Function framepool_inUse
+ * Desc     number of blocks currently borrowed
+ */
+uint8_t framepool_inUse(void)
+{
+  return framepool_count;
+}
+
+/* 
+ * Function framepool_highWater
+ * Desc     largest number of blocks ever borrowed at once, for sizing
+ *          FRAMEPOOL_BLOCKS
+ */
+uint8_t framepool_highWater(void)
+{
+  return framepool_max;
+}
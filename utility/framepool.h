@@ -0,0 +1,27 @@
+/*
+  framepool.h - Fixed-block frame buffer pool shared by the Linkbot library
+  and the TWI layer.
+*/
+
+#ifndef framepool_h
+#define framepool_h
+
+  #include <inttypes.h>
+  #include "twi.h"
+
+  // every block holds one complete TWI frame
+  #define FRAMEPOOL_BLOCK_SIZE TWI_BUFFER_LENGTH
+
+  // number of blocks; at most 16. The last free block is only lent to
+  // framepool_borrowUrgent, so urgent frames always find one
+  #ifndef FRAMEPOOL_BLOCKS
+  #define FRAMEPOOL_BLOCKS 6
+  #endif
+
+  uint8_t* framepool_borrow(void);
+  uint8_t* framepool_borrowUrgent(void);
+  void framepool_return(uint8_t*);
+  uint8_t framepool_inUse(void);
+  uint8_t framepool_highWater(void);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+  framing.c - Byte-stuffing and CRC-8 for the framed Link-Layer mode.
+
+  The CRC is CRC-8 with polynomial 0x07, computed a nibble at a time from a
+  16 entry table to keep it small.
+*/
+
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+#include "framing.h"
+#include "commands.h"
+
+#define FRAMING_XOR 0x20
+
+static const uint8_t framing_crcTable[16] PROGMEM = {
+  0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+  0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+};
+
+/* 
+ * Function framing_crc8
+ * Desc     continues a CRC-8 over a series of bytes
+ * Input    crc: CRC so far, 0 to start
+ *          data: pointer to byte array
+ *          length: number of bytes in array
+ * Output   the updated CRC
+ */
+uint8_t framing_crc8(uint8_t crc, const uint8_t* data, uint8_t length)
+{
+  uint8_t i;
+  for(i = 0; i < length; ++i){
+    crc = (crc << 4) ^ pgm_read_byte(&framing_crcTable[(crc ^ data[i]) >> 4]);
+    crc = (crc << 4) ^ pgm_read_byte(&framing_crcTable[(crc >> 4) ^ (data[i] & 0x0f)]);
+  }
+  return crc;
+}
+
+/* 
+ * Function framing_stuff
+ * Desc     escapes every MSG_ESCAPE byte in place, working back
+ *          from the end so no second buffer is needed
+ * Input    data: bytes to escape
+ *          length: number of bytes in data
+ *          room: size of data
+ * Output   number of escaped bytes, or 0 if they would not fit, in which
+ *          case data is left as it was
+ */
+uint8_t framing_stuff(uint8_t* data, uint8_t length, uint8_t room)
+{
+  uint8_t i;
+  uint8_t n = length;
+  for(i = 0; i < length; ++i){
+    if(MSG_ESCAPE == data[i]){
+      ++n;
+    }
+  }
+  if(n > room || n < length){
+    return 0;
+  }
+  room = n;
+  while(i > 0){
+    --i;
+    if(MSG_ESCAPE == data[i]){
+      data[--room] = data[i] ^ FRAMING_XOR;
+      data[--room] = MSG_ESCAPE;
+    }else{
+      data[--room] = data[i];
+    }
+  }
+  return n;
+}
+
+/* 
+ * Function framing_unstuff
+ * Desc     undoes framing_stuff in place
+ * Input    data: escaped bytes
+ *          length: number of bytes in data
+ * Output   number of bytes left, or 0 if an escape was cut short
+ */
+uint8_t framing_unstuff(uint8_t* data, uint8_t length)
+{
+  uint8_t i;
+  uint8_t n = 0;
+  for(i = 0; i < length; ++i){
+    if(MSG_ESCAPE == data[i]){
+      if(++i >= length){
+        return 0;
+      }
+      data[n++] = data[i] ^ FRAMING_XOR;
+    }else{
+      data[n++] = data[i];
+    }
+  }
+  return n;
+}
@@ -0,0 +1,21 @@
+/*
+  framing.h - Byte-stuffing and CRC-8 for the framed Link-Layer mode.
+
+  In a framed message, the terminator is replaced by a CRC-8 of the command
+  byte and arguments, and the arguments and CRC are byte-stuffed: MSG_ESCAPE
+  is sent as MSG_ESCAPE followed by the byte xor 0x20. The size byte bounds
+  the message, so 0x00 needs no escape. A new terminator follows. A framed
+  response is stuffed from its RESP_OK byte on and ends in a CRC-8 of the
+  bytes before it.
+*/
+
+#ifndef framing_h
+#define framing_h
+
+  #include <inttypes.h>
+
+  uint8_t framing_crc8(uint8_t, const uint8_t*, uint8_t);
+  uint8_t framing_stuff(uint8_t*, uint8_t, uint8_t);
+  uint8_t framing_unstuff(uint8_t*, uint8_t);
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
@@ -37,6 +38,7 @@
 
 #include "pins_arduino.h"
 #include "twi.h"
+#include "framepool.h"
 
 volatile uint8_t twi_state;
 static volatile uint8_t twi_slarw;
@@ -46,19 +48,60 @@ static volatile uint8_t twi_inRepStart;			// in the middle of a repeated start
 static void (*twi_onSlaveTransmit)(void);
 static void (*twi_onSlaveReceive)(uint8_t*, int);
 
-static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
+// Buffers are borrowed from the frame pool only while a transfer is in
+// progress. A blocking master transfer uses the caller's buffer directly.
+static uint8_t* twi_masterBuffer;
 static volatile uint8_t twi_masterBufferIndex;
 static volatile uint8_t twi_masterBufferLength;
 
-static uint8_t twi_txBuffer[TWI_BUFFER_LENGTH];
+static uint8_t* volatile twi_txBuffer;
 static volatile uint8_t twi_txBufferIndex;
 static volatile uint8_t twi_txBufferLength;
 
-static uint8_t twi_rxBuffer[TWI_BUFFER_LENGTH];
+static uint8_t* volatile twi_rxBuffer;
 static volatile uint8_t twi_rxBufferIndex;
 
 static volatile uint8_t twi_error;
 
+// Queued asynchronous master transfers. The transfer at the head of the
+// queue is the one on the bus while twi_async is set. One entry more than
+// TWI_QUEUE_LENGTH is kept so an urgent transfer always finds room.
+typedef struct {
+  uint8_t address;
+  uint8_t read;
+  uint8_t length;
+  uint8_t sendStop;
+  uint8_t retries;
+  uint8_t* buffer;
+  twi_callback_t callback;
+  void* context;
+} twi_transfer_t;
+
+#define TWI_QUEUE_SLOTS (TWI_QUEUE_LENGTH + 1)
+static twi_transfer_t twi_queue[TWI_QUEUE_SLOTS];
+static volatile uint8_t twi_queueHead;
+static volatile uint8_t twi_queueCount;
+static volatile uint8_t twi_async;
+// set while a blocking write-then-read holds the bus across its repeated
+// start, keeping queued transfers from slipping in between
+static volatile uint8_t twi_held;
+
+// The frame of the urgent transfer queued, if any. The caller hands it over
+// rather than it being copied, so an urgent write never needs a block
+// from the frame pool.
+static uint8_t* volatile twi_urgentBuffer;
+
+// Multi-master bus sharing. After losing arbitration, or after a burst of
+// transfers, queued transfers are held off for a while so the other masters
+// get a turn. Each node's backoff is drawn from its own random sequence.
+static volatile uint8_t twi_holdoff;
+static volatile unsigned long twi_holdoffUntil;
+static volatile uint8_t twi_burst;
+static uint8_t twi_rand = 1;
+static twi_stats_t twi_stats;
+
+static void twi_startNext(void);
+
 /* 
  * Function twi_init
  * Desc     readys twi pins and sets twi bitrate
@@ -100,47 +143,43 @@ void twi_setAddress(uint8_t address)
 {
   // set twi slave address (skip over TWGCE bit)
   TWAR = address << 1;
+  // nodes on one bus have distinct addresses; seed the backoff with it
+  twi_rand ^= address;
 }
 
 /* 
- * Function twi_readFrom
- * Desc     attempts to become twi bus master and read a
- *          series of bytes from a device on the bus
+ * Function twi_begin
+ * Desc     starts a master transfer on a claimed bus
  * Input    address: 7bit i2c device address
- *          data: pointer to byte array
- *          length: number of bytes to read into array
- *          sendStop: Boolean indicating whether to send a stop at the end
- * Output   number of bytes read
+ *          rw: TW_READ or TW_WRITE
+ *          buffer: bytes to send, or room for the bytes to receive
+ *          length: number of bytes
+ *          sendStop: boolean indicating whether to send a stop at the end
+ * Output   none
  */
-uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sendStop)
+static void twi_begin(uint8_t address, uint8_t rw, uint8_t* buffer, uint8_t length, uint8_t sendStop)
 {
-  uint8_t i;
-
-  // ensure data will fit into buffer
-  if(TWI_BUFFER_LENGTH < length){
-    return 0;
-  }
-
-  // wait until twi is ready, become master receiver
-  while(TWI_READY != twi_state){
-    continue;
-  }
-  twi_state = TWI_MRX;
+  twi_state = (TW_READ == rw) ? TWI_MRX : TWI_MTX;
   twi_sendStop = sendStop;
   // reset error state (0xFF.. no error occured)
-  twi_error = 0xFF;
+  twi_error = TWI_NO_ERROR;
 
   // initialize buffer iteration vars
+  twi_masterBuffer = buffer;
   twi_masterBufferIndex = 0;
-  twi_masterBufferLength = length-1;  // This is not intuitive, read on...
-  // On receive, the previously configured ACK/NACK setting is transmitted in
-  // response to the received byte before the interrupt is signalled. 
-  // Therefor we must actually set NACK when the _next_ to last byte is
-  // received, causing that NACK to be sent in response to receiving the last
-  // expected byte of data.
+  if(TW_READ == rw){
+    twi_masterBufferLength = length-1;  // This is not intuitive, read on...
+    // On receive, the previously configured ACK/NACK setting is transmitted in
+    // response to the received byte before the interrupt is signalled. 
+    // Therefor we must actually set NACK when the _next_ to last byte is
+    // received, causing that NACK to be sent in response to receiving the last
+    // expected byte of data.
+  }else{
+    twi_masterBufferLength = length;
+  }
 
   // build sla+w, slave device address + w bit
-  twi_slarw = TW_READ;
+  twi_slarw = rw;
   twi_slarw |= address << 1;
 
   if (true == twi_inRepStart) {
@@ -156,21 +195,113 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
   }
   else
     // send start condition
-    TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
+    TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);	// enable INTs
+}
 
-  // wait for read operation to complete
-  while(TWI_MRX == twi_state){
-    continue;
+/* 
+ * Function twi_backoff
+ * Desc     picks a random wait before retrying a transfer which lost
+ *          arbitration. The range doubles with each retry.
+ * Input    retries: number of times the transfer has been retried
+ * Output   wait in milliseconds, at least 1
+ */
+static uint8_t twi_backoff(uint8_t retries)
+{
+  twi_rand = twi_rand * 109 + 89;
+  return 1 + twi_rand % (2 << retries);
+}
+
+/* 
+ * Function twi_holdFor
+ * Desc     keeps queued transfers from starting for a while
+ * Input    ms: milliseconds to wait at least, 0 for none
+ * Output   none
+ */
+static void twi_holdFor(uint8_t ms)
+{
+  // part of the current millisecond has gone already, so count one more
+  twi_holdoffUntil = millis() + ms + 1;
+  twi_holdoff = (0 != ms);
+}
+
+/* 
+ * Function twi_claim
+ * Desc     waits until the bus is idle and no queued transfer is waiting,
+ *          then takes it for a blocking transfer
+ * Input    state: TWI_MRX or TWI_MTX
+ * Output   none
+ */
+static void twi_claim(uint8_t state)
+{
+  uint8_t sreg;
+  while(1){
+    sreg = SREG;
+    cli();
+    // queued transfers held off must drain first
+    twi_startNext();
+    if(TWI_READY == twi_state && 0 == twi_queueCount){
+      twi_state = state;
+      SREG = sreg;
+      return;
+    }
+    SREG = sreg;
+  }
+}
+
+/* 
+ * Function twi_run
+ * Desc     runs a blocking master transfer to its end, retrying after a
+ *          random backoff when arbitration is lost to another master
+ * Input    see twi_begin
+ * Output   none; the outcome is left in twi_error
+ */
+static void twi_run(uint8_t address, uint8_t rw, uint8_t* buffer, uint8_t length, uint8_t sendStop)
+{
+  uint8_t state = (TW_READ == rw) ? TWI_MRX : TWI_MTX;
+  uint8_t retries;
+
+  for(retries = 0; ; ++retries){
+    twi_claim(state);
+    twi_begin(address, rw, buffer, length, sendStop);
+    while(state == twi_state){
+      continue;
+    }
+    if(TW_MT_ARB_LOST != twi_error){
+      return;
+    }
+    if(TWI_ARB_RETRIES <= retries){
+      twi_stats.dropped++;
+      return;
+    }
+    twi_stats.retries++;
+    delay(twi_backoff(retries));
+  }
+}
+
+/* 
+ * Function twi_readFrom
+ * Desc     attempts to become twi bus master and read a
+ *          series of bytes from a device on the bus
+ * Input    address: 7bit i2c device address
+ *          data: pointer to byte array
+ *          length: number of bytes to read into array
+ *          sendStop: Boolean indicating whether to send a stop at the end
+ * Output   number of bytes read
+ */
+uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sendStop)
+{
+  // ensure data will fit into buffer
+  if(TWI_BUFFER_LENGTH < length){
+    return 0;
   }
 
+  // become master receiver; we wait for the read to complete, so receive
+  // straight into data
+  twi_run(address, TW_READ, data, length, sendStop);
+
   if (twi_masterBufferIndex < length)
     length = twi_masterBufferIndex;
 
-  // copy twi buffer to data
-  for(i = 0; i < length; ++i){
-    data[i] = twi_masterBuffer[i];
-  }
-	
   return length;
 }
 
@@ -184,75 +315,325 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
  *          wait: boolean indicating to wait for write or not
  *          sendStop: boolean indicating whether or not to send a stop at the end
  * Output   0 .. success
- *          1 .. length to long for buffer
+ *          1 .. length to long for buffer, or no room to queue the write
  *          2 .. address send, NACK received
  *          3 .. data send, NACK received
- *          4 .. other twi error (lost bus arbitration, bus error, ..)
+ *          4 .. other twi error (bus error, ..)
+ *          5 .. lost bus arbitration TWI_ARB_RETRIES times over
  */
 uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait, uint8_t sendStop)
 {
-  uint8_t i;
-
   // ensure data will fit into buffer
   if(TWI_BUFFER_LENGTH < length){
     return 1;
   }
 
-  // wait until twi is ready, become master transmitter
-  while(TWI_READY != twi_state){
-    continue;
-  }
-  twi_state = TWI_MTX;
-  twi_sendStop = sendStop;
-  // reset error state (0xFF.. no error occured)
-  twi_error = 0xFF;
-
-  // initialize buffer iteration vars
-  twi_masterBufferIndex = 0;
-  twi_masterBufferLength = length;
-  
-  // copy data to twi buffer
-  for(i = 0; i < length; ++i){
-    twi_masterBuffer[i] = data[i];
-  }
-  
-  // build sla+w, slave device address + w bit
-  twi_slarw = TW_WRITE;
-  twi_slarw |= address << 1;
-  
-  // if we're in a repeated start, then we've already sent the START
-  // in the ISR. Don't do it again.
-  //
-  if (true == twi_inRepStart) {
-    // if we're in the repeated start state, then we've already sent the start,
-    // (@@@ we hope), and the TWI statemachine is just waiting for the address byte.
-    // We need to remove ourselves from the repeated start state before we enable interrupts,
-    // since the ISR is ASYNC, and we could get confused if we hit the ISR before cleaning
-    // up. Also, don't enable the START interrupt. There may be one pending from the 
-    // repeated start that we sent outselves, and that would really confuse things.
-    twi_inRepStart = false;			// remember, we're dealing with an ASYNC ISR
-    TWDR = twi_slarw;				
-    TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);	// enable INTs, but not START
+  // without waiting, this is an asynchronous write nobody hears back from
+  if(!wait){
+    return twi_writeToAsync(address, data, length, sendStop, 0, 0) ? 1 : 0;
   }
-  else
-    // send start condition
-    TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);	// enable INTs
 
-  // wait for write operation to complete
-  while(wait && (TWI_MTX == twi_state)){
-    continue;
-  }
+  // become master transmitter; data outlives the transfer, send it in place
+  twi_run(address, TW_WRITE, data, length, sendStop);
   
-  if (twi_error == 0xFF)
+  if (twi_error == TWI_NO_ERROR)
     return 0;	// success
   else if (twi_error == TW_MT_SLA_NACK)
     return 2;	// error: address send, nack received
   else if (twi_error == TW_MT_DATA_NACK)
     return 3;	// error: data send, nack received
+  else if (twi_error == TW_MT_ARB_LOST)
+    return 5;	// error: lost arbitration, retries exhausted
   else
     return 4;	// other twi error
 }
 
+/* 
+ * Function twi_writeRead
+ * Desc     attempts to become twi bus master, write a series of bytes to a
+ *          device on the bus and read a series of bytes back after a
+ *          repeated start. No other transfer can take the bus in between.
+ * Input    address: 7bit i2c device address
+ *          wdata: pointer to byte array to write
+ *          wlength: number of bytes in wdata
+ *          rdata: pointer to byte array to read into
+ *          rlength: number of bytes to read
+ * Output   0 .. success
+ *          1 .. length too long for buffer
+ *          2 .. address send, NACK received
+ *          3 .. data send, NACK received
+ *          4 .. other twi error, or fewer than rlength bytes read
+ *          5 .. lost bus arbitration TWI_ARB_RETRIES times over
+ */
+uint8_t twi_writeRead(uint8_t address, uint8_t* wdata, uint8_t wlength,
+                      uint8_t* rdata, uint8_t rlength)
+{
+  uint8_t rc = 0;
+  uint8_t retries;
+  uint8_t sreg;
+
+  if(TWI_BUFFER_LENGTH < wlength || TWI_BUFFER_LENGTH < rlength || 0 == rlength){
+    return 1;
+  }
+
+  // arbitration can only be lost before the repeated start, so only the
+  // write is retried
+  for(retries = 0; ; ++retries){
+    twi_claim(TWI_MTX);
+    twi_held = true;
+    twi_begin(address, TW_WRITE, wdata, wlength, false);
+    while(TWI_MTX == twi_state){
+      continue;
+    }
+    if(TW_MT_ARB_LOST != twi_error){
+      break;
+    }
+    twi_held = false;
+    if(TWI_ARB_RETRIES <= retries){
+      twi_stats.dropped++;
+      break;
+    }
+    twi_stats.retries++;
+    delay(twi_backoff(retries));
+  }
+
+  if(twi_error == TW_MT_SLA_NACK){
+    rc = 2;
+  }else if(twi_error == TW_MT_DATA_NACK){
+    rc = 3;
+  }else if(twi_error == TW_MT_ARB_LOST){
+    rc = 5;
+  }else if(twi_error != TWI_NO_ERROR){
+    rc = 4;
+  }else{
+    // the repeated start has been sent; the bus is still ours
+    twi_state = TWI_MRX;
+    twi_begin(address, TW_READ, rdata, rlength, true);
+    while(TWI_MRX == twi_state){
+      continue;
+    }
+    if(twi_masterBufferIndex < rlength){
+      rc = 4;
+    }
+  }
+
+  sreg = SREG;
+  cli();
+  twi_held = false;
+  twi_startNext();
+  SREG = sreg;
+  return rc;
+}
+
+/* 
+ * Function twi_enqueue
+ * Desc     queues an asynchronous master transfer and starts it if the
+ *          bus is idle. An urgent transfer goes ahead of everything queued
+ *          and only waits for the transfer already on the bus.
+ * Input    see twi_writeToAsync; data is 0 for reads
+ *          urgent: boolean indicating whether to jump the queue
+ * Output   0 .. queued
+ *          1 .. length too long, queue full, no pool buffer free or an
+ *               urgent transfer already queued
+ */
+static uint8_t twi_enqueue(uint8_t address, uint8_t read, const uint8_t* data, uint8_t length,
+                           uint8_t sendStop, twi_callback_t callback, void* context,
+                           uint8_t urgent)
+{
+  uint8_t i;
+  uint8_t sreg;
+  uint8_t* buffer;
+  twi_transfer_t* t;
+
+  if(TWI_BUFFER_LENGTH < length || 0 == length){
+    return 1;
+  }
+  sreg = SREG;
+  if(urgent){
+    cli();
+    if(twi_urgentBuffer){
+      SREG = sreg;
+      return 1;
+    }
+    buffer = (uint8_t*)data;
+    twi_urgentBuffer = buffer;
+    SREG = sreg;
+  }else{
+    buffer = framepool_borrow();
+    if(0 == buffer){
+      return 1;
+    }
+    for(i = 0; data && i < length; ++i){
+      buffer[i] = data[i];
+    }
+  }
+
+  cli();
+  if(urgent){
+    // no holdoff applies to it
+    twi_holdoff = false;
+    // the head is on the bus while twi_async is set; move it back one
+    // entry so the urgent transfer follows it directly
+    twi_queueHead = (twi_queueHead + TWI_QUEUE_SLOTS - 1) % TWI_QUEUE_SLOTS;
+    if(twi_async){
+      twi_queue[twi_queueHead] = twi_queue[(twi_queueHead + 1) % TWI_QUEUE_SLOTS];
+      t = &twi_queue[(twi_queueHead + 1) % TWI_QUEUE_SLOTS];
+    }else{
+      t = &twi_queue[twi_queueHead];
+    }
+  }else{
+    if(TWI_QUEUE_LENGTH <= twi_queueCount){
+      SREG = sreg;
+      framepool_return(buffer);
+      return 1;
+    }
+    t = &twi_queue[(twi_queueHead + twi_queueCount) % TWI_QUEUE_SLOTS];
+  }
+  t->address = address;
+  t->read = read;
+  t->length = length;
+  t->sendStop = sendStop;
+  t->retries = 0;
+  t->buffer = buffer;
+  t->callback = callback;
+  t->context = context;
+  twi_queueCount++;
+  twi_startNext();
+  SREG = sreg;
+  return 0;
+}
+
+/* 
+ * Function twi_writeToAsync
+ * Desc     queues a write of a series of bytes to a device on the bus and
+ *          returns at once. The data is copied, so the caller's buffer may
+ *          be reused immediately.
+ * Input    address: 7bit i2c device address
+ *          data: pointer to byte array
+ *          length: number of bytes in array
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ *          callback: called from the TWI interrupt when the write ends, or 0
+ *          context: passed to callback
+ * Output   0 .. queued
+ *          1 .. length too long, queue full or no pool buffer free
+ */
+uint8_t twi_writeToAsync(uint8_t address, const uint8_t* data, uint8_t length, uint8_t sendStop,
+                         twi_callback_t callback, void* context)
+{
+  return twi_enqueue(address, false, data, length, sendStop, callback, context, false);
+}
+
+/* 
+ * Function twi_readFromAsync
+ * Desc     queues a read of a series of bytes from a device on the bus and
+ *          returns at once. The bytes read are handed to callback, and are
+ *          only valid until it returns.
+ * Input    address: 7bit i2c device address
+ *          length: number of bytes to read
+ *          sendStop: boolean indicating whether or not to send a stop at the end
+ *          callback: called from the TWI interrupt when the read ends
+ *          context: passed to callback
+ * Output   0 .. queued
+ *          1 .. length too long, queue full or no pool buffer free
+ */
+uint8_t twi_readFromAsync(uint8_t address, uint8_t length, uint8_t sendStop,
+                          twi_callback_t callback, void* context)
+{
+  return twi_enqueue(address, true, 0, length, sendStop, callback, context, false);
+}
+
+/* 
+ * Function twi_writeToUrgent
+ * Desc     like twi_writeToAsync, but the write goes ahead of every queued
+ *          transfer and starts as soon as the transfer on the bus ends.
+ *          Only one urgent write may be queued at a time.
+ * Input    see twi_writeToAsync; data must be a block from the frame pool,
+ *          which is handed over and returned to the pool once sent
+ * Output   0 .. queued
+ *          1 .. length too long or an urgent write already queued
+ */
+uint8_t twi_writeToUrgent(uint8_t address, uint8_t* data, uint8_t length, uint8_t sendStop,
+                          twi_callback_t callback, void* context)
+{
+  return twi_enqueue(address, false, data, length, sendStop, callback, context, true);
+}
+
+/* 
+ * Function twi_pending
+ * Desc     number of asynchronous transfers queued or on the bus
+ */
+uint8_t twi_pending(void)
+{
+  return twi_queueCount;
+}
+
+/* 
+ * Function twi_service
+ * Desc     starts the next queued transfer once a holdoff has passed. Call
+ *          it while waiting on queued transfers.
+ * Input    none
+ * Output   none
+ */
+void twi_service(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  twi_startNext();
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_getStats
+ * Desc     copies the bus sharing counters
+ * Input    stats: where to copy them
+ * Output   none
+ */
+void twi_getStats(twi_stats_t* stats)
+{
+  uint8_t sreg = SREG;
+  cli();
+  *stats = twi_stats;
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_resetStats
+ * Desc     clears the bus sharing counters
+ * Input    none
+ * Output   none
+ */
+void twi_resetStats(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  memset(&twi_stats, 0, sizeof(twi_stats));
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_startNext
+ * Desc     starts the transfer at the head of the queue if the bus is idle.
+ *          Called with interrupts disabled, or from the TWI interrupt.
+ * Input    none
+ * Output   none
+ */
+static void twi_startNext(void)
+{
+  twi_transfer_t* t;
+  if(TWI_READY != twi_state || twi_async || twi_held || 0 == twi_queueCount){
+    return;
+  }
+  if(twi_holdoff){
+    if((long)(millis() - twi_holdoffUntil) < 0){
+      return;
+    }
+    twi_holdoff = false;
+  }
+  t = &twi_queue[twi_queueHead];
+  twi_async = true;
+  twi_begin(t->address, t->read ? TW_READ : TW_WRITE, t->buffer, t->length, t->sendStop);
+}
+
 /* 
  * Function twi_transmit
  * Desc     fills slave tx buffer with data
@@ -277,6 +658,11 @@ uint8_t twi_transmit(const uint8_t* data, uint8_t length)
     return 2;
   }
   
+  // the pool was exhausted when we were addressed
+  if(0 == twi_txBuffer){
+    return 1;
+  }
+
   // set length and copy data into tx buffer
   twi_txBufferLength = length;
   for(i = 0; i < length; ++i){
@@ -360,6 +746,61 @@ void twi_releaseBus(void)
   twi_state = TWI_READY;
 }
 
+/* 
+ * Function twi_masterDone
+ * Desc     completes the master transfer which just ended: an asynchronous
+ *          transfer is taken off the queue, its callback is told the
+ *          outcome, and the next queued transfer is started. Must be called
+ *          once the bus has been stopped or released.
+ * Input    none
+ * Output   none
+ */
+static void twi_masterDone(void)
+{
+  twi_transfer_t t;
+  if(TW_MT_ARB_LOST == twi_error){
+    twi_stats.arbLost++;
+  }else{
+    twi_stats.transfers++;
+  }
+  if(twi_async){
+    twi_async = false;
+    t = twi_queue[twi_queueHead];
+    if(TW_MT_ARB_LOST == twi_error){
+      if(TWI_ARB_RETRIES > t.retries){
+        // leave it at the head of the queue and try again after a backoff;
+        // an urgent transfer retries as soon as the bus is free
+        twi_queue[twi_queueHead].retries++;
+        twi_stats.retries++;
+        twi_holdFor((t.buffer == twi_urgentBuffer) ? 0 : twi_backoff(t.retries));
+        twi_startNext();
+        return;
+      }
+      twi_stats.dropped++;
+    }
+    twi_queueHead = (twi_queueHead + 1) % TWI_QUEUE_SLOTS;
+    twi_queueCount--;
+    if(t.callback){
+      t.callback(twi_error, t.buffer, twi_masterBufferIndex, t.context);
+    }
+    if(t.buffer == twi_urgentBuffer){
+      twi_urgentBuffer = 0;
+    }
+    framepool_return(t.buffer);
+    // after a burst of transfers, pause so other masters get a turn, unless
+    // an urgent transfer is next
+    if(0 == twi_queueCount){
+      twi_burst = 0;
+    }else if(TWI_FAIR_BURST <= ++twi_burst &&
+             twi_queue[twi_queueHead].buffer != twi_urgentBuffer){
+      twi_burst = 0;
+      twi_stats.yields++;
+      twi_holdFor(1);
+    }
+  }
+  twi_startNext();
+}
+
 SIGNAL(TWI_vect)
 {
   switch(TW_STATUS){
@@ -390,19 +831,23 @@ SIGNAL(TWI_vect)
 	  TWCR = _BV(TWINT) | _BV(TWSTA)| _BV(TWEN) ;
 	  twi_state = TWI_READY;
 	}
+        twi_masterDone();
       }
       break;
     case TW_MT_SLA_NACK:  // address sent, nack received
       twi_error = TW_MT_SLA_NACK;
       twi_stop();
+      twi_masterDone();
       break;
     case TW_MT_DATA_NACK: // data sent, nack received
       twi_error = TW_MT_DATA_NACK;
       twi_stop();
+      twi_masterDone();
       break;
     case TW_MT_ARB_LOST: // lost bus arbitration
       twi_error = TW_MT_ARB_LOST;
       twi_releaseBus();
+      twi_masterDone();
       break;
 
     // Master Receiver
@@ -430,27 +875,38 @@ SIGNAL(TWI_vect)
 	  TWCR = _BV(TWINT) | _BV(TWSTA)| _BV(TWEN) ;
 	  twi_state = TWI_READY;
 	}    
+      twi_masterDone();
 	break;
     case TW_MR_SLA_NACK: // address sent, nack received
+      twi_error = TW_MR_SLA_NACK;
       twi_stop();
+      twi_masterDone();
       break;
     // TW_MR_ARB_LOST handled by TW_MT_ARB_LOST case
 
     // Slave Receiver
-    case TW_SR_SLA_ACK:   // addressed, returned ack
-    case TW_SR_GCALL_ACK: // addressed generally, returned ack
     case TW_SR_ARB_LOST_SLA_ACK:   // lost arbitration, returned ack
     case TW_SR_ARB_LOST_GCALL_ACK: // lost arbitration, returned ack
+      // our master transfer lost to the master addressing us
+      twi_error = TW_MT_ARB_LOST;
+      twi_state = TWI_SRX;
+      twi_masterDone();
+    case TW_SR_SLA_ACK:   // addressed, returned ack
+    case TW_SR_GCALL_ACK: // addressed generally, returned ack
       // enter slave receiver mode
       twi_state = TWI_SRX;
       // indicate that rx buffer can be overwritten and ack
       twi_rxBufferIndex = 0;
-      twi_reply(1);
+      if(0 == twi_rxBuffer){
+        twi_rxBuffer = framepool_borrow();
+      }
+      // without a buffer, nack the data
+      twi_reply(0 != twi_rxBuffer);
       break;
     case TW_SR_DATA_ACK:       // data received, returned ack
     case TW_SR_GCALL_DATA_ACK: // data received generally, returned ack
       // if there is still room in the rx buffer
-      if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
+      if(twi_rxBuffer && twi_rxBufferIndex < TWI_BUFFER_LENGTH){
         // put byte in buffer and ack
         twi_rxBuffer[twi_rxBufferIndex++] = TWDR;
         twi_reply(1);
@@ -460,18 +916,25 @@ SIGNAL(TWI_vect)
       }
       break;
     case TW_SR_STOP: // stop or repeated start condition received
-      // put a null char after data if there's room
-      if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
-        twi_rxBuffer[twi_rxBufferIndex] = '\0';
-      }
       // sends ack and stops interface for clock stretching
       twi_stop();
-      // callback to user defined callback
-      twi_onSlaveReceive(twi_rxBuffer, twi_rxBufferIndex);
+      if(twi_rxBuffer){
+        // put a null char after data if there's room
+        if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
+          twi_rxBuffer[twi_rxBufferIndex] = '\0';
+        }
+        // callback to user defined callback
+        twi_onSlaveReceive(twi_rxBuffer, twi_rxBufferIndex);
+        // the callback has copied what it needs, give the buffer back
+        framepool_return(twi_rxBuffer);
+        twi_rxBuffer = 0;
+      }
       // since we submit rx buffer to "wire" library, we can reset it
       twi_rxBufferIndex = 0;
       // ack future responses and leave slave receiver state
       twi_releaseBus();
+      // the bus is ours again, start any transfer queued meanwhile
+      twi_startNext();
       break;
     case TW_SR_DATA_NACK:       // data received, returned nack
     case TW_SR_GCALL_DATA_NACK: // data received generally, returned nack
@@ -480,26 +943,38 @@ SIGNAL(TWI_vect)
       break;
     
     // Slave Transmitter
-    case TW_ST_SLA_ACK:          // addressed, returned ack
     case TW_ST_ARB_LOST_SLA_ACK: // arbitration lost, returned ack
+      // our master transfer lost to the master addressing us
+      twi_error = TW_MT_ARB_LOST;
+      twi_state = TWI_STX;
+      twi_masterDone();
+    case TW_ST_SLA_ACK:          // addressed, returned ack
       // enter slave transmitter mode
       twi_state = TWI_STX;
       // ready the tx buffer index for iteration
       twi_txBufferIndex = 0;
       // set tx buffer length to be zero, to verify if user changes it
       twi_txBufferLength = 0;
+      if(0 == twi_txBuffer){
+        twi_txBuffer = framepool_borrow();
+      }
       // request for txBuffer to be filled and length to be set
       // note: user must call twi_transmit(bytes, length) to do this
-      twi_onSlaveTransmit();
+      if(twi_onSlaveTransmit){
+        twi_onSlaveTransmit();
+      }
       // if they didn't change buffer & length, initialize it
       if(0 == twi_txBufferLength){
         twi_txBufferLength = 1;
-        twi_txBuffer[0] = 0x00;
+        if(twi_txBuffer){
+          twi_txBuffer[0] = 0x00;
+        }
       }
       // transmit first byte from buffer, fall
     case TW_ST_DATA_ACK: // byte sent, ack returned
-      // copy data to output register
-      TWDR = twi_txBuffer[twi_txBufferIndex++];
+      // copy data to output register, or a null byte if the pool was empty
+      TWDR = twi_txBuffer ? twi_txBuffer[twi_txBufferIndex] : 0x00;
+      twi_txBufferIndex++;
       // if there is more to send, ack, otherwise nack
       if(twi_txBufferIndex < twi_txBufferLength){
         twi_reply(1);
@@ -511,8 +986,11 @@ SIGNAL(TWI_vect)
     case TW_ST_LAST_DATA: // received ack, but we are done already!
       // ack future responses
       twi_reply(1);
+      framepool_return(twi_txBuffer);
+      twi_txBuffer = 0;
       // leave slave receiver state
       twi_state = TWI_READY;
+      twi_startNext();
       break;
 
     // All
@@ -521,6 +999,7 @@ SIGNAL(TWI_vect)
     case TW_BUS_ERROR: // bus error, illegal stop/start
       twi_error = TW_BUS_ERROR;
       twi_stop();
+      twi_masterDone();
       break;
   }
 }
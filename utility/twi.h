@@ -32,6 +32,24 @@
   #define TWI_BUFFER_LENGTH 32
   #endif
 
+  #ifndef TWI_QUEUE_LENGTH
+  #define TWI_QUEUE_LENGTH 4
+  #endif
+
+  // times a transfer is retried after losing arbitration to another master
+  #ifndef TWI_ARB_RETRIES
+  #define TWI_ARB_RETRIES 4
+  #endif
+
+  // transfers started back to back before pausing to let other masters in
+  #ifndef TWI_FAIR_BURST
+  #define TWI_FAIR_BURST 4
+  #endif
+
+  // error code handed to callbacks of transfers which succeeded; failed
+  // transfers get the TW_* status which ended them
+  #define TWI_NO_ERROR 0xFF
+
   #define TWI_READY 0
   #define TWI_MRX   1
   #define TWI_MTX   2
@@ -39,11 +57,32 @@
   #define TWI_STX   4
 
   extern volatile uint8_t twi_state;
+
+  // called from the TWI interrupt when an asynchronous transfer ends, with
+  // the bytes sent or received
+  typedef void (*twi_callback_t)(uint8_t error, uint8_t* data, uint8_t length, void* context);
   
+  // bus sharing counters of this node
+  typedef struct {
+    uint16_t transfers;   // master transfers which ran to the end
+    uint16_t arbLost;     // arbitrations lost to another master
+    uint16_t retries;     // transfers restarted after losing arbitration
+    uint16_t dropped;     // transfers given up after TWI_ARB_RETRIES losses
+    uint16_t yields;      // pauses made to let other masters in
+  } twi_stats_t;
+
   void twi_init(void);
   void twi_setAddress(uint8_t);
   uint8_t twi_readFrom(uint8_t, uint8_t*, uint8_t, uint8_t);
   uint8_t twi_writeTo(uint8_t, uint8_t*, uint8_t, uint8_t, uint8_t);
+  uint8_t twi_writeRead(uint8_t, uint8_t*, uint8_t, uint8_t*, uint8_t);
+  uint8_t twi_writeToAsync(uint8_t, const uint8_t*, uint8_t, uint8_t, twi_callback_t, void*);
+  uint8_t twi_readFromAsync(uint8_t, uint8_t, uint8_t, twi_callback_t, void*);
+  uint8_t twi_writeToUrgent(uint8_t, uint8_t*, uint8_t, uint8_t, twi_callback_t, void*);
+  uint8_t twi_pending(void);
+  void twi_service(void);
+  void twi_getStats(twi_stats_t*);
+  void twi_resetStats(void);
   uint8_t twi_transmit(const uint8_t*, uint8_t);
   void twi_attachSlaveRxEvent( void (*)(uint8_t*, int) );
   void twi_attachSlaveTxEvent( void (*)(void) );